@@ -0,0 +1,312 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <chrono>
+#include <map>
+#include <string>
+
+// System:
+#include <poll.h>
+
+// Lib:
+#include <libusb.h>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+// Local:
+#include "asio.h"
+
+
+namespace libusb {
+namespace asio {
+
+namespace {
+
+class ErrorCategory: public boost::system::error_category
+{
+  public:
+	char const*
+	name() const noexcept override
+	{
+		return "libusb";
+	}
+
+	std::string
+	message (int code) const override
+	{
+		return libusb_strerror (static_cast<libusb_error> (code));
+	}
+};
+
+} // namespace
+
+
+boost::system::error_category const&
+error_category() noexcept
+{
+	static ErrorCategory category;
+	return category;
+}
+
+
+/**
+ * State shared with asio handlers. Handlers hold weak references,
+ * and run on the strand, so they're serialized with pollfd changes.
+ */
+class EventDriver::State: public std::enable_shared_from_this<State>
+{
+	typedef boost::asio::posix::stream_descriptor	Descriptor;
+	typedef Descriptor::wait_type					WaitType;
+
+  public:
+	// Ctor
+	explicit State (Bus&, boost::asio::io_context&);
+
+	// Dtor
+	~State();
+
+	/**
+	 * Return the strand all handlers run on.
+	 */
+	boost::asio::strand<boost::asio::io_context::executor_type>&
+	strand() noexcept;
+
+	/**
+	 * Start watching file descriptor.
+	 */
+	void
+	add (PollFD const&);
+
+	/**
+	 * Stop watching file descriptor.
+	 */
+	void
+	remove (int fd);
+
+	/**
+	 * Handle libusb events and rearm the timeout timer.
+	 */
+	void
+	process();
+
+  private:
+	/**
+	 * Wait for the descriptor to become ready.
+	 */
+	void
+	wait (Descriptor&, WaitType);
+
+	/**
+	 * Arm timer for libusb's next timeout, if libusb needs it.
+	 */
+	void
+	schedule_timer();
+
+  private:
+	Bus&												_bus;
+	boost::asio::io_context&							_io_context;
+	boost::asio::strand<boost::asio::io_context::executor_type>
+														_strand;
+	boost::asio::steady_timer							_timer;
+	std::map<int, std::unique_ptr<Descriptor>>			_descriptors;
+};
+
+
+EventDriver::State::State (Bus& bus, boost::asio::io_context& io_context):
+	_bus (bus),
+	_io_context (io_context),
+	_strand (boost::asio::make_strand (io_context)),
+	_timer (io_context)
+{ }
+
+
+EventDriver::State::~State()
+{
+	// File descriptors belong to libusb, so release instead of closing them:
+	for (auto& d: _descriptors)
+		d.second->release();
+}
+
+
+inline boost::asio::strand<boost::asio::io_context::executor_type>&
+EventDriver::State::strand() noexcept
+{
+	return _strand;
+}
+
+
+void
+EventDriver::State::add (PollFD const& pollfd)
+{
+	remove (pollfd.fd);
+
+	auto& descriptor = _descriptors[pollfd.fd];
+	descriptor = std::make_unique<Descriptor> (_io_context, pollfd.fd);
+
+	if (pollfd.events & POLLIN)
+		wait (*descriptor, Descriptor::wait_read);
+
+	if (pollfd.events & POLLOUT)
+		wait (*descriptor, Descriptor::wait_write);
+
+	schedule_timer();
+}
+
+
+void
+EventDriver::State::remove (int fd)
+{
+	auto found = _descriptors.find (fd);
+
+	if (found != _descriptors.end())
+	{
+		// Cancels pending waits without closing:
+		found->second->release();
+		_descriptors.erase (found);
+	}
+}
+
+
+void
+EventDriver::State::process()
+{
+	try {
+		_bus.process_ready();
+	}
+	catch (StatusException const&)
+	{
+		// Nothing to report it to. Retried on next readiness.
+	}
+
+	schedule_timer();
+}
+
+
+void
+EventDriver::State::wait (Descriptor& descriptor, WaitType wait_type)
+{
+	std::weak_ptr<State> weak_self = shared_from_this();
+	Descriptor* descriptor_ptr = &descriptor;
+
+	descriptor.async_wait (wait_type, boost::asio::bind_executor (_strand, [weak_self, descriptor_ptr, wait_type](boost::system::error_code const& error) {
+		// Aborted when the descriptor was removed:
+		if (error)
+			return;
+
+		if (auto self = weak_self.lock())
+		{
+			self->process();
+
+			// Rearm, unless the descriptor got removed by process():
+			for (auto const& d: self->_descriptors)
+				if (d.second.get() == descriptor_ptr)
+					self->wait (*descriptor_ptr, wait_type);
+		}
+	}));
+}
+
+
+void
+EventDriver::State::schedule_timer()
+{
+	// On most platforms timeouts are signalled through one of the pollfds:
+	if (_bus.pollfds_handle_timeouts())
+		return;
+
+	Optional<std::chrono::microseconds> timeout;
+
+	try {
+		timeout = _bus.next_timeout();
+	}
+	catch (StatusException const&)
+	{
+		timeout = std::chrono::milliseconds (1);
+	}
+
+	if (timeout)
+	{
+		std::weak_ptr<State> weak_self = shared_from_this();
+
+		_timer.expires_after (*timeout);
+		_timer.async_wait (boost::asio::bind_executor (_strand, [weak_self](boost::system::error_code const& error) {
+			if (!error)
+				if (auto self = weak_self.lock())
+					self->process();
+		}));
+	}
+	else
+		_timer.cancel();
+}
+
+
+EventDriver::EventDriver (Bus& bus, boost::asio::io_context& io_context):
+	_bus (bus),
+	_io_context (io_context),
+	_state (std::make_shared<State> (bus, io_context))
+{
+	_bus.acquire_external_event_handling();
+
+	std::weak_ptr<State> weak_state = _state;
+
+	// Notifications may come from any thread calling libusb, so pass them through the strand:
+	auto added = [weak_state](PollFD const& pollfd) {
+		if (auto state = weak_state.lock())
+			boost::asio::post (state->strand(), [weak_state, pollfd] {
+				if (auto state = weak_state.lock())
+					state->add (pollfd);
+			});
+	};
+
+	auto removed = [weak_state](int fd) {
+		if (auto state = weak_state.lock())
+			boost::asio::post (state->strand(), [weak_state, fd] {
+				if (auto state = weak_state.lock())
+					state->remove (fd);
+			});
+	};
+
+	try {
+		_notifier = std::make_unique<PollFDNotifier> (bus, added, removed, true);
+	}
+	catch (...)
+	{
+		_bus.release_external_event_handling();
+		throw;
+	}
+
+	// Handle events that may already be pending:
+	boost::asio::post (_state->strand(), [weak_state] {
+		if (auto state = weak_state.lock())
+			state->process();
+	});
+}
+
+
+EventDriver::~EventDriver()
+{
+	_notifier.reset();
+
+	try {
+		_bus.release_external_event_handling();
+	}
+	catch (...)
+	{
+		// Nothing to report it to. Users of the event thread are left without it.
+	}
+}
+
+} // namespace asio
+} // namespace libusb
@@ -0,0 +1,300 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__ASIO_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__ASIO_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Lib:
+#include <libusb.h>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+
+// Local:
+#include "libusbcc.h"
+#include "event_loop.h"
+#include "transfer.h"
+
+
+namespace libusb {
+namespace asio {
+
+/**
+ * Return error category for libusb_error codes.
+ */
+boost::system::error_category const&
+error_category() noexcept;
+
+/**
+ * Return error_code for given libusb_error. LIBUSB_SUCCESS maps to no error.
+ */
+boost::system::error_code
+make_error_code (libusb_error) noexcept;
+
+
+/**
+ * Drives libusb event handling from a boost::asio::io_context: libusb's
+ * pollfds are registered with the io_context (and kept up to date through
+ * PollFDNotifier), and Bus::process_ready() is called whenever any of them
+ * becomes ready or libusb's next timeout expires. Transfer callbacks are
+ * therefore called from threads running the io_context.
+ *
+ * The driver takes over event handling with Bus::acquire_external_event_handling():
+ * the Bus's event thread is stopped (if running) and isn't started again for
+ * as long as the driver exists, even if acquired, e.g. by HotplugSubscription.
+ * Hotplug callbacks are then also called from threads running the io_context.
+ *
+ * Initiating functions follow asio completion-token conventions, with
+ * signature void (boost::system::error_code, std::size_t bytes_transferred).
+ * Handlers are posted to their associated executor (by default the
+ * io_context's one), never run inline from libusb event handling. The executor
+ * is kept busy with a work guard until the operation completes. Errors from
+ * starting an operation are reported to the handler as well. Each operation
+ * allocates a Transfer; use Transfer directly to reuse them.
+ *
+ * The Bus must outlive the EventDriver. There should be at most one
+ * EventDriver per Bus (see PollFDNotifier). Destroy it from a thread running
+ * the io_context or while the io_context isn't running. POSIX only.
+ */
+class EventDriver
+{
+	class State;
+
+  public:
+	typedef boost::asio::io_context::executor_type executor_type;
+
+  public:
+	/**
+	 * Ctor
+	 * Must not be called from within the Bus's event thread.
+	 * May throw StatusException.
+	 */
+	explicit EventDriver (Bus&, boost::asio::io_context&);
+
+	EventDriver (EventDriver const&) = delete;
+
+	// Dtor
+	~EventDriver();
+
+	EventDriver&
+	operator= (EventDriver const&) = delete;
+
+	/**
+	 * Return the io_context's executor.
+	 */
+	executor_type
+	get_executor() const noexcept;
+
+	/**
+	 * Start asynchronous bulk transfer from the device.
+	 * The buffer must stay valid until the operation completes.
+	 */
+	template<class CompletionToken>
+		auto
+		async_bulk_read (Device&, uint8_t endpoint, boost::asio::mutable_buffer, CompletionToken&&);
+
+	/**
+	 * Start asynchronous bulk transfer to the device.
+	 * The buffer must stay valid until the operation completes.
+	 */
+	template<class CompletionToken>
+		auto
+		async_bulk_write (Device&, uint8_t endpoint, boost::asio::const_buffer, CompletionToken&&);
+
+	/**
+	 * Start asynchronous control transfer in the direction given by the
+	 * ControlTransfer. For In transfers the data is received into the buffer,
+	 * which must stay valid until the operation completes. For Out transfers
+	 * the data is copied before the function returns.
+	 */
+	template<class CompletionToken>
+		auto
+		async_control (Device&, ControlTransfer const&, boost::asio::mutable_buffer, CompletionToken&&);
+
+  private:
+	/**
+	 * Submit transfer, arrange for the handler to be called on completion.
+	 */
+	template<class Handler>
+		void
+		submit (Transfer&, Handler&&);
+
+	/**
+	 * Arrange for the handler to be called with given error, for operations
+	 * that couldn't be started.
+	 */
+	template<class Handler>
+		void
+		post_error (Handler&&, libusb_error);
+
+  private:
+	Bus&							_bus;
+	boost::asio::io_context&		_io_context;
+	Shared<State>					_state;
+	// Destroyed first, so that no notifications arrive during destruction:
+	std::unique_ptr<PollFDNotifier>	_notifier;
+};
+
+
+inline boost::system::error_code
+make_error_code (libusb_error error) noexcept
+{
+	return { static_cast<int> (error), error_category() };
+}
+
+
+inline EventDriver::executor_type
+EventDriver::get_executor() const noexcept
+{
+	return _io_context.get_executor();
+}
+
+
+template<class CompletionToken>
+	inline auto
+	EventDriver::async_bulk_read (Device& device, uint8_t endpoint, boost::asio::mutable_buffer buffer, CompletionToken&& token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, std::size_t)> (
+			[this, &device, endpoint, buffer](auto&& handler) {
+				Shared<Transfer> transfer;
+
+				try {
+					transfer = Transfer::create (device);
+					transfer->fill_bulk_read (endpoint, { static_cast<uint8_t*> (buffer.data()), buffer.size() });
+				}
+				catch (StatusException const& e)
+				{
+					post_error (std::forward<decltype (handler)> (handler), e.status());
+					return;
+				}
+
+				submit (*transfer, std::forward<decltype (handler)> (handler));
+			},
+			token);
+	}
+
+
+template<class CompletionToken>
+	inline auto
+	EventDriver::async_bulk_write (Device& device, uint8_t endpoint, boost::asio::const_buffer buffer, CompletionToken&& token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, std::size_t)> (
+			[this, &device, endpoint, buffer](auto&& handler) {
+				Shared<Transfer> transfer;
+
+				try {
+					transfer = Transfer::create (device);
+					transfer->fill_bulk_write (endpoint, { static_cast<uint8_t const*> (buffer.data()), buffer.size() });
+				}
+				catch (StatusException const& e)
+				{
+					post_error (std::forward<decltype (handler)> (handler), e.status());
+					return;
+				}
+
+				submit (*transfer, std::forward<decltype (handler)> (handler));
+			},
+			token);
+	}
+
+
+template<class CompletionToken>
+	inline auto
+	EventDriver::async_control (Device& device, ControlTransfer const& ct, boost::asio::mutable_buffer buffer, CompletionToken&& token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void (boost::system::error_code, std::size_t)> (
+			[this, &device, ct, buffer](auto&& handler) {
+				Shared<Transfer> transfer;
+				Span<uint8_t> span (static_cast<uint8_t*> (buffer.data()), buffer.size());
+
+				try {
+					transfer = Transfer::create (device);
+
+					if (ct.direction == Direction::In)
+						transfer->fill_control_read (ct, span);
+					else
+						transfer->fill_control_write (ct, span);
+				}
+				catch (StatusException const& e)
+				{
+					post_error (std::forward<decltype (handler)> (handler), e.status());
+					return;
+				}
+
+				submit (*transfer, std::forward<decltype (handler)> (handler));
+			},
+			token);
+	}
+
+
+template<class Handler>
+	inline void
+	EventDriver::submit (Transfer& transfer, Handler&& handler)
+	{
+		// Transfer callbacks must be copyable, asio handlers may be move-only:
+		auto shared_handler = std::make_shared<std::decay_t<Handler>> (std::forward<Handler> (handler));
+		auto executor = boost::asio::get_associated_executor (*shared_handler, get_executor());
+		// Keep the handler's executor from running out of work while the transfer is pending:
+		auto work = boost::asio::make_work_guard (executor);
+
+		try {
+			transfer.submit ([shared_handler, executor, work](Transfer& transfer) mutable {
+				auto error = make_error_code (to_error (transfer.status()));
+				auto length = transfer.actual_length();
+
+				// Never run inline, the handler could re-enter libusb event handling:
+				boost::asio::post (executor, [shared_handler, error, length] {
+					std::move (*shared_handler) (error, length);
+				});
+
+				// Posted handler is counted as work on its own:
+				work.reset();
+			});
+		}
+		catch (StatusException const& e)
+		{
+			// Handlers must not be invoked from within the initiating function:
+			boost::asio::post (executor, [shared_handler, error = make_error_code (e.status())] {
+				std::move (*shared_handler) (error, 0);
+			});
+		}
+	}
+
+
+template<class Handler>
+	inline void
+	EventDriver::post_error (Handler&& handler, libusb_error error)
+	{
+		auto executor = boost::asio::get_associated_executor (handler, get_executor());
+
+		// Handlers must not be invoked from within the initiating function:
+		boost::asio::post (executor, [handler = std::forward<Handler> (handler), error = make_error_code (error)]() mutable {
+			std::move (handler) (error, 0);
+		});
+	}
+
+} // namespace asio
+} // namespace libusb
+
+#endif
@@ -0,0 +1,100 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+#include <memory>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "bos_descriptor.h"
+
+
+namespace libusb {
+
+BOSDescriptor::BOSDescriptor (libusb_device_handle* handle)
+{
+	libusb_bos_descriptor* raw_bos;
+	int err = libusb_get_bos_descriptor (handle, &raw_bos);
+	if (is_error (err))
+		throw StatusException (static_cast<libusb_error> (err));
+
+	// Freed also if parsing throws:
+	std::unique_ptr<libusb_bos_descriptor, decltype (&libusb_free_bos_descriptor)> bos (raw_bos, &libusb_free_bos_descriptor);
+
+	for (uint8_t i = 0; i < bos->bNumDeviceCaps; ++i)
+	{
+		auto capability = bos->dev_capability[i];
+		_capability_types.push_back (capability->bDevCapabilityType);
+
+		switch (capability->bDevCapabilityType)
+		{
+			case LIBUSB_BT_USB_2_0_EXTENSION:
+			{
+				libusb_usb_2_0_extension_descriptor* ext;
+
+				if (libusb_get_usb_2_0_extension_descriptor (nullptr, capability, &ext) == LIBUSB_SUCCESS)
+				{
+					USB2Extension parsed;
+					parsed.attributes = ext->bmAttributes;
+					// Bit 1 is LPM:
+					parsed.lpm_supported = ext->bmAttributes & 0x02;
+					_usb_2_0_extension = parsed;
+					libusb_free_usb_2_0_extension_descriptor (ext);
+				}
+				break;
+			}
+
+			case LIBUSB_BT_SS_USB_DEVICE_CAPABILITY:
+			{
+				libusb_ss_usb_device_capability_descriptor* ss;
+
+				if (libusb_get_ss_usb_device_capability_descriptor (nullptr, capability, &ss) == LIBUSB_SUCCESS)
+				{
+					SuperSpeedCapability parsed;
+					parsed.attributes = ss->bmAttributes;
+					// Bit 1 is LTM:
+					parsed.ltm_capable = ss->bmAttributes & 0x02;
+					parsed.speeds_supported = ss->wSpeedSupported;
+					parsed.functionality_support = ss->bFunctionalitySupport;
+					parsed.u1_exit_latency = ss->bU1DevExitLat;
+					parsed.u2_exit_latency = ss->bU2DevExitLat;
+					_superspeed = parsed;
+					libusb_free_ss_usb_device_capability_descriptor (ss);
+				}
+				break;
+			}
+
+			case LIBUSB_BT_CONTAINER_ID:
+			{
+				libusb_container_id_descriptor* container_id;
+
+				if (libusb_get_container_id_descriptor (nullptr, capability, &container_id) == LIBUSB_SUCCESS)
+				{
+					std::array<uint8_t, 16> uuid;
+					std::copy (std::begin (container_id->ContainerID), std::end (container_id->ContainerID), uuid.begin());
+					_container_id = uuid;
+					libusb_free_container_id_descriptor (container_id);
+				}
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+}
+
+} // namespace libusb
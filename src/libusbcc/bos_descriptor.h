@@ -0,0 +1,133 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__BOS_DESCRIPTOR_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__BOS_DESCRIPTOR_H__INCLUDED
+
+// Standard:
+#include <array>
+#include <cstddef>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * Parsed USB 2.0 Extension capability.
+ */
+class USB2Extension
+{
+  public:
+	uint32_t	attributes				= 0;
+	bool		lpm_supported			= false;
+};
+
+
+/**
+ * Parsed SuperSpeed USB Device capability.
+ */
+class SuperSpeedCapability
+{
+  public:
+	uint8_t		attributes				= 0;
+	bool		ltm_capable				= false;
+	// Bitmap: bit 0 low-speed, 1 full-speed, 2 high-speed, 3 SuperSpeed:
+	uint16_t	speeds_supported		= 0;
+	uint8_t		functionality_support	= 0;
+	uint8_t		u1_exit_latency			= 0;
+	uint16_t	u2_exit_latency			= 0;
+};
+
+
+/**
+ * Binary Object Store descriptor with its device capabilities parsed upfront.
+ * libusb structures are freed right after parsing.
+ * Obtain it with Device::bos_descriptor(), which caches it.
+ */
+class BOSDescriptor
+{
+  public:
+	/**
+	 * Ctor
+	 * Reads the descriptor from the device. May throw StatusException.
+	 */
+	explicit BOSDescriptor (libusb_device_handle*);
+
+	/**
+	 * Return types (bDevCapabilityType) of all device capabilities.
+	 */
+	std::vector<uint8_t> const&
+	capability_types() const noexcept;
+
+	/**
+	 * Return USB 2.0 Extension capability, if present.
+	 */
+	Optional<USB2Extension> const&
+	usb_2_0_extension() const noexcept;
+
+	/**
+	 * Return SuperSpeed USB Device capability, if present.
+	 */
+	Optional<SuperSpeedCapability> const&
+	superspeed() const noexcept;
+
+	/**
+	 * Return Container ID (UUID of the device), if present.
+	 */
+	Optional<std::array<uint8_t, 16>> const&
+	container_id() const noexcept;
+
+  private:
+	std::vector<uint8_t>				_capability_types;
+	Optional<USB2Extension>				_usb_2_0_extension;
+	Optional<SuperSpeedCapability>		_superspeed;
+	Optional<std::array<uint8_t, 16>>	_container_id;
+};
+
+
+inline std::vector<uint8_t> const&
+BOSDescriptor::capability_types() const noexcept
+{
+	return _capability_types;
+}
+
+
+inline Optional<USB2Extension> const&
+BOSDescriptor::usb_2_0_extension() const noexcept
+{
+	return _usb_2_0_extension;
+}
+
+
+inline Optional<SuperSpeedCapability> const&
+BOSDescriptor::superspeed() const noexcept
+{
+	return _superspeed;
+}
+
+
+inline Optional<std::array<uint8_t, 16>> const&
+BOSDescriptor::container_id() const noexcept
+{
+	return _container_id;
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,199 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+
+// Standard:
+#include <cstdlib>
+#include <utility>
+
+// System:
+#include <unistd.h>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "buffer_pool.h"
+
+
+namespace libusb {
+
+BufferPool::Buffer::Buffer (Shared<BufferPool> pool, Block block) noexcept:
+	_pool (std::move (pool)),
+	_block (block)
+{ }
+
+
+void
+BufferPool::Buffer::release() noexcept
+{
+	if (_pool && _block.data)
+		_pool->release (_block);
+
+	_pool.reset();
+	_block = Block();
+}
+
+
+BufferPool::BufferPool (Shared<low_level::DeviceHandle> handle, std::size_t buffer_size, Memory memory):
+	_handle (handle),
+	_buffer_size (buffer_size),
+	_memory (memory)
+{ }
+
+
+Shared<BufferPool>
+BufferPool::create (Device const& device, std::size_t buffer_size, Memory memory)
+{
+	if (!device._handle || buffer_size == 0)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	// Ctor is private, so std::make_shared() can't be used:
+	return Shared<BufferPool> (new BufferPool (device._handle, buffer_size, memory));
+}
+
+
+BufferPool::~BufferPool()
+{
+	// Buffers in use keep the pool alive, so all blocks are on the free list now:
+	for (auto const& block: _free)
+		deallocate (block);
+}
+
+
+BufferPool::Buffer
+BufferPool::acquire()
+{
+	Block block;
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+
+		if (!_free.empty())
+		{
+			block = _free.back();
+			_free.pop_back();
+		}
+	}
+
+	if (!block.data)
+		block = allocate();
+
+	return Buffer (shared_from_this(), block);
+}
+
+
+void
+BufferPool::reserve (std::size_t count)
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	while (_free.size() < count)
+	{
+		lock.unlock();
+		auto block = allocate();
+		lock.lock();
+		_free.push_back (block);
+	}
+}
+
+
+std::size_t
+BufferPool::allocated() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _allocated;
+}
+
+
+std::size_t
+BufferPool::dev_mem_allocated() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _dev_mem_allocated;
+}
+
+
+BufferPool::Block
+BufferPool::allocate()
+{
+	Block block;
+	bool try_dev_mem;
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		try_dev_mem = _memory == Memory::Device && !_dev_mem_failed;
+	}
+
+	if (try_dev_mem)
+	{
+		block.data = libusb_dev_mem_alloc (_handle->get(), _buffer_size);
+		block.dev_mem = block.data != nullptr;
+	}
+
+	if (!block.data)
+	{
+		// Page alignment, same as what libusb_dev_mem_alloc() returns:
+		void* memory = nullptr;
+		auto const page_size = ::sysconf (_SC_PAGESIZE);
+		auto const alignment = page_size > 0 ? static_cast<std::size_t> (page_size) : 4096;
+
+		if (::posix_memalign (&memory, alignment, _buffer_size) != 0)
+			throw StatusException (LIBUSB_ERROR_NO_MEM);
+
+		block.data = static_cast<uint8_t*> (memory);
+	}
+
+	std::lock_guard<std::mutex> lock (_mutex);
+	++_allocated;
+
+	if (block.dev_mem)
+		++_dev_mem_allocated;
+	else if (try_dev_mem)
+		_dev_mem_failed = true;
+
+	return block;
+}
+
+
+void
+BufferPool::deallocate (Block block) noexcept
+{
+	if (block.dev_mem)
+		libusb_dev_mem_free (_handle->get(), block.data, _buffer_size);
+	else
+		::free (block.data);
+}
+
+
+void
+BufferPool::release (Block block) noexcept
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	try {
+		_free.push_back (block);
+	}
+	catch (...)
+	{
+		// Can't grow the free list, so just free the block:
+		--_allocated;
+
+		if (block.dev_mem)
+			--_dev_mem_allocated;
+
+		deallocate (block);
+	}
+}
+
+} // namespace libusb
@@ -0,0 +1,274 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+
+#ifndef MULABS_ORG__LIBUSBCC__BUFFER_POOL_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__BUFFER_POOL_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * Pool of equally-sized transfer buffers for a device.
+ *
+ * With Memory::Device buffers are allocated with libusb_dev_mem_alloc(),
+ * which on Linux maps memory the kernel can DMA into directly, so transfers
+ * don't need a copy between kernel and user space. Where that's not supported
+ * (other platforms, old kernels, or after the kernel's usbfs memory limit is
+ * reached), page-aligned heap memory is used instead. Memory::Heap always
+ * uses heap memory.
+ *
+ * Buffers are returned to the pool when their Buffer handle is destroyed
+ * and reused by later acquire() calls, so after warming up (see reserve())
+ * nothing is allocated. Pass buffers to Transfer::fill_*() or to streams;
+ * a Buffer must outlive transfers using it.
+ *
+ * Pools are always owned by Shared<> pointers (see create()), and each Buffer
+ * keeps its pool (and the device handle) alive. Thread-safe.
+ */
+class BufferPool: public std::enable_shared_from_this<BufferPool>
+{
+	class Block
+	{
+	  public:
+		uint8_t*	data		= nullptr;
+		bool		dev_mem		= false;
+	};
+
+  public:
+	enum class Memory
+	{
+		Device,
+		Heap,
+	};
+
+	/**
+	 * RAII handle for a buffer from the pool. Movable, not copyable.
+	 * Returns the buffer to the pool in dtor.
+	 */
+	class Buffer
+	{
+		friend class BufferPool;
+
+	  public:
+		// Ctor
+		Buffer() = default;
+
+		// Move ctor
+		Buffer (Buffer&&) noexcept;
+
+		// Dtor
+		~Buffer();
+
+		Buffer&
+		operator= (Buffer&&) noexcept;
+
+		/**
+		 * Return true if the handle holds a buffer.
+		 */
+		explicit
+		operator bool() const noexcept;
+
+		uint8_t*
+		data() const noexcept;
+
+		/**
+		 * Return buffer size, same as the pool's buffer_size(),
+		 * or 0 for empty handles.
+		 */
+		std::size_t
+		size() const noexcept;
+
+		/**
+		 * Return true if the buffer was allocated with libusb_dev_mem_alloc().
+		 */
+		bool
+		is_dev_mem() const noexcept;
+
+	  private:
+		// Ctor
+		explicit Buffer (Shared<BufferPool>, Block) noexcept;
+
+		/**
+		 * Return the buffer to the pool.
+		 */
+		void
+		release() noexcept;
+
+	  private:
+		Shared<BufferPool>	_pool;
+		Block				_block;
+	};
+
+  public:
+	/**
+	 * Create pool of buffers of given size for the device.
+	 */
+	static Shared<BufferPool>
+	create (Device const&, std::size_t buffer_size, Memory = Memory::Device);
+
+	BufferPool (BufferPool const&) = delete;
+
+	// Dtor
+	~BufferPool();
+
+	BufferPool&
+	operator= (BufferPool const&) = delete;
+
+	/**
+	 * Return size of each buffer.
+	 */
+	std::size_t
+	buffer_size() const noexcept;
+
+	/**
+	 * Take a free buffer, or allocate a new one if there are none.
+	 * Throws StatusException (LIBUSB_ERROR_NO_MEM) if allocation fails.
+	 */
+	Buffer
+	acquire();
+
+	/**
+	 * Allocate buffers so that at least count of them are free.
+	 */
+	void
+	reserve (std::size_t count);
+
+	/**
+	 * Return number of buffers allocated by the pool, free or not.
+	 */
+	std::size_t
+	allocated() const;
+
+	/**
+	 * Return how many of allocated() buffers are device memory.
+	 */
+	std::size_t
+	dev_mem_allocated() const;
+
+  private:
+	// Ctor
+	explicit BufferPool (Shared<low_level::DeviceHandle>, std::size_t buffer_size, Memory);
+
+	/**
+	 * Allocate new block, device memory if possible.
+	 */
+	Block
+	allocate();
+
+	/**
+	 * Free block allocated with allocate().
+	 */
+	void
+	deallocate (Block) noexcept;
+
+	/**
+	 * Put block back on the free list.
+	 */
+	void
+	release (Block) noexcept;
+
+  private:
+	Shared<low_level::DeviceHandle>	_handle;
+	std::size_t						_buffer_size;
+	Memory							_memory;
+	mutable std::mutex				_mutex;
+	std::vector<Block>				_free;
+	std::size_t						_allocated			= 0;
+	std::size_t						_dev_mem_allocated	= 0;
+	// Set when libusb_dev_mem_alloc() fails, so that it's not retried for each buffer:
+	bool							_dev_mem_failed		= false;
+};
+
+
+inline
+BufferPool::Buffer::Buffer (Buffer&& other) noexcept:
+	_pool (std::move (other._pool)),
+	_block (other._block)
+{
+	other._block = Block();
+}
+
+
+inline
+BufferPool::Buffer::~Buffer()
+{
+	release();
+}
+
+
+inline BufferPool::Buffer&
+BufferPool::Buffer::operator= (Buffer&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		_pool = std::move (other._pool);
+		_block = other._block;
+		other._block = Block();
+	}
+
+	return *this;
+}
+
+
+inline
+BufferPool::Buffer::operator bool() const noexcept
+{
+	return _block.data != nullptr;
+}
+
+
+inline uint8_t*
+BufferPool::Buffer::data() const noexcept
+{
+	return _block.data;
+}
+
+
+inline std::size_t
+BufferPool::Buffer::size() const noexcept
+{
+	return _pool ? _pool->buffer_size() : 0;
+}
+
+
+inline bool
+BufferPool::Buffer::is_dev_mem() const noexcept
+{
+	return _block.dev_mem;
+}
+
+
+inline std::size_t
+BufferPool::buffer_size() const noexcept
+{
+	return _buffer_size;
+}
+
+} // namespace libusb
+
+#endif
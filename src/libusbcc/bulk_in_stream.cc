@@ -0,0 +1,226 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "bulk_in_stream.h"
+
+
+namespace libusb {
+
+BulkInStream::BulkInStream (Device const& device, uint8_t endpoint, std::size_t transfer_size, std::size_t queue_depth, std::size_t ring_capacity,
+							Shared<BufferPool> pool):
+	_ring (ring_capacity)
+{
+	if (!pool)
+		pool = BufferPool::create (device, transfer_size, BufferPool::Memory::Heap);
+	else if (pool->buffer_size() < transfer_size)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_buffers.reserve (queue_depth);
+	_transfers.reserve (queue_depth);
+
+	for (std::size_t i = 0; i < queue_depth; ++i)
+	{
+		_buffers.push_back (pool->acquire());
+		_transfers.push_back (Transfer::create (device));
+		_transfers.back()->fill_bulk_read (endpoint, { _buffers.back().data(), transfer_size });
+	}
+}
+
+
+BulkInStream::BulkInStream (Device const& device, uint8_t endpoint, TransferPolicy const& policy, std::size_t ring_capacity,
+							Shared<BufferPool> pool):
+	BulkInStream (device, endpoint, policy.transfer_size(), policy.queue_depth(), ring_capacity, pool)
+{ }
+
+
+BulkInStream::~BulkInStream()
+{
+	stop();
+}
+
+
+void
+BulkInStream::start()
+{
+	_stopping = false;
+	_error = LIBUSB_SUCCESS;
+
+	for (auto& transfer: _transfers)
+	{
+		if (transfer->in_flight())
+			continue;
+
+		++_in_flight;
+
+		try {
+			transfer->submit ([this](Transfer& transfer) {
+				handle_completion (transfer);
+			});
+		}
+		catch (...)
+		{
+			--_in_flight;
+			stop();
+			throw;
+		}
+	}
+}
+
+
+void
+BulkInStream::stop()
+{
+	_stopping = true;
+
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	// A callback that checked _stopping just before it was set may still resubmit
+	// its transfer, so keep cancelling until all are done:
+	do {
+		for (auto& transfer: _transfers)
+			transfer->cancel();
+	}
+	while (!_state_changed.wait_for (lock, std::chrono::milliseconds (10), [this] { return _in_flight.load() == 0; }));
+}
+
+
+Optional<libusb_error>
+BulkInStream::error() const noexcept
+{
+	auto error = static_cast<libusb_error> (_error.load());
+
+	if (error == LIBUSB_SUCCESS)
+		return { };
+	else
+		return error;
+}
+
+
+std::size_t
+BulkInStream::read (Span<uint8_t> buffer, std::chrono::milliseconds timeout)
+{
+	if (auto n = read (buffer))
+		return n;
+
+	std::unique_lock<std::mutex> lock (_mutex);
+	// Seq-cst store pairs with the fence in handle_completion(), so that either
+	// the consumer sees new data, or the producer sees the consumer waiting:
+	_consumer_waiting.store (true);
+	_state_changed.wait_for (lock, timeout, [this] { return available() > 0 || !running(); });
+	_consumer_waiting.store (false);
+	lock.unlock();
+
+	return read (buffer);
+}
+
+
+BulkInStream::Statistics
+BulkInStream::statistics() const noexcept
+{
+	Statistics result;
+	result.transfers = _transfers_count.load (std::memory_order_relaxed);
+	result.bytes = _bytes.load (std::memory_order_relaxed);
+	result.overflows = _overflows.load (std::memory_order_relaxed);
+	result.bytes_dropped = _bytes_dropped.load (std::memory_order_relaxed);
+	return result;
+}
+
+
+void
+BulkInStream::handle_completion (Transfer& transfer)
+{
+	switch (transfer.status())
+	{
+		case TransferStatus::Completed:
+		case TransferStatus::TimedOut:
+		{
+			auto data = transfer.data();
+			auto written = _ring.write (data);
+
+			_transfers_count.fetch_add (1, std::memory_order_relaxed);
+			_bytes.fetch_add (data.size(), std::memory_order_relaxed);
+
+			if (written < data.size())
+			{
+				_overflows.fetch_add (1, std::memory_order_relaxed);
+				_bytes_dropped.fetch_add (data.size() - written, std::memory_order_relaxed);
+			}
+
+			std::atomic_thread_fence (std::memory_order_seq_cst);
+
+			if (written > 0 && _consumer_waiting.load())
+			{
+				std::lock_guard<std::mutex> lock (_mutex);
+				_state_changed.notify_all();
+			}
+
+			break;
+		}
+
+		case TransferStatus::Cancelled:
+			break;
+
+		default:
+			// Stall, overflow, disconnection: stop the stream and report the error:
+			fail (to_error (transfer.status()));
+			break;
+	}
+
+	if (!_stopping.load())
+	{
+		try {
+			transfer.resubmit();
+
+			// The stream may have failed in another callback after _stopping was checked:
+			if (_stopping.load())
+				transfer.cancel();
+
+			return;
+		}
+		catch (StatusException const& e)
+		{
+			fail (e.status());
+		}
+	}
+
+	transfer_finished();
+}
+
+
+void
+BulkInStream::fail (libusb_error error)
+{
+	_error = error;
+	_stopping = true;
+
+	// Stop the other transfers from writing into the ring:
+	for (auto& transfer: _transfers)
+		transfer->cancel();
+}
+
+
+void
+BulkInStream::transfer_finished()
+{
+	// Notify under the mutex, so that a waiter can't miss it between
+	// checking the predicate and going to sleep:
+	std::lock_guard<std::mutex> lock (_mutex);
+	--_in_flight;
+	_state_changed.notify_all();
+}
+
+} // namespace libusb
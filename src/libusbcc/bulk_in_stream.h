@@ -0,0 +1,218 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__BULK_IN_STREAM_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__BULK_IN_STREAM_H__INCLUDED
+
+// Standard:
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "buffer_pool.h"
+#include "ring_buffer.h"
+#include "transfer.h"
+#include "transfer_policy.h"
+
+
+namespace libusb {
+
+/**
+ * Continuous reading from a bulk IN endpoint.
+ *
+ * Keeps a number of transfers submitted at all times: each is resubmitted
+ * from its completion callback, so the host controller always has a request
+ * queued and no data is missed between requests. Received data is passed to
+ * a single consumer thread through a lock-free ring buffer. If the consumer
+ * falls behind and the ring buffer fills up, data that doesn't fit is dropped
+ * and counted in statistics().
+ *
+ * Completion callbacks run in the thread handling libusb events, which must
+ * be running (see Bus::acquire_event_thread()).
+ */
+class BulkInStream
+{
+  public:
+	class Statistics
+	{
+	  public:
+		// Completed transfers:
+		uint64_t	transfers		= 0;
+		// Bytes received from the device (including dropped ones):
+		uint64_t	bytes			= 0;
+		// Transfers whose data didn't fit into the ring buffer:
+		uint64_t	overflows		= 0;
+		// Bytes dropped due to overflows:
+		uint64_t	bytes_dropped	= 0;
+	};
+
+  public:
+	/**
+	 * Ctor
+	 *
+	 * \param	endpoint
+	 * 			Endpoint address. The direction bit is set.
+	 * \param	transfer_size
+	 * 			Size of a single transfer. Should be a multiple of
+	 * 			the endpoint's max. packet size.
+	 * \param	queue_depth
+	 * 			Number of transfers kept in flight.
+	 * \param	ring_capacity
+	 * 			Size of the ring buffer in bytes.
+	 * \param	pool
+	 * 			Pool to take transfer buffers from, eg. to use device memory.
+	 * 			Its buffer_size() must be at least transfer_size. If null,
+	 * 			buffers are allocated on the heap.
+	 */
+	explicit BulkInStream (Device const&, uint8_t endpoint, std::size_t transfer_size, std::size_t queue_depth, std::size_t ring_capacity,
+						   Shared<BufferPool> pool = nullptr);
+
+	/**
+	 * Ctor
+	 * Take transfer size and queue depth from the policy.
+	 */
+	explicit BulkInStream (Device const&, uint8_t endpoint, TransferPolicy const&, std::size_t ring_capacity,
+						   Shared<BufferPool> pool = nullptr);
+
+	BulkInStream (BulkInStream const&) = delete;
+
+	// Dtor
+	~BulkInStream();
+
+	BulkInStream&
+	operator= (BulkInStream const&) = delete;
+
+	/**
+	 * Submit all transfers. May throw StatusException; already submitted
+	 * transfers are cancelled then.
+	 */
+	void
+	start();
+
+	/**
+	 * Cancel all transfers and block until they have completed. Data already
+	 * in the ring buffer can still be read. Must not be called from the thread
+	 * handling libusb events.
+	 */
+	void
+	stop();
+
+	/**
+	 * Return true if any transfers are in flight.
+	 */
+	bool
+	running() const noexcept;
+
+	/**
+	 * Return error that stopped the stream (eg. LIBUSB_ERROR_NO_DEVICE
+	 * on disconnection), if any. Reset by start().
+	 */
+	Optional<libusb_error>
+	error() const noexcept;
+
+	/**
+	 * Return number of bytes ready to be read.
+	 */
+	std::size_t
+	available() const noexcept;
+
+	/**
+	 * Take up to buffer.size() bytes from the ring buffer without blocking.
+	 * Consumer thread only. Return number of bytes read.
+	 */
+	std::size_t
+	read (Span<uint8_t> buffer) noexcept;
+
+	/**
+	 * Like read (Span<uint8_t>), but wait up to timeout for data
+	 * if none is available. Return 0 on timeout or if the stream
+	 * has stopped.
+	 */
+	std::size_t
+	read (Span<uint8_t> buffer, std::chrono::milliseconds timeout);
+
+	/**
+	 * Return transfer and overflow counters.
+	 */
+	Statistics
+	statistics() const noexcept;
+
+  private:
+	/**
+	 * Transfer completion callback.
+	 */
+	void
+	handle_completion (Transfer&);
+
+	/**
+	 * Record error and cancel all transfers, so that the stream stops.
+	 */
+	void
+	fail (libusb_error);
+
+	/**
+	 * Mark transfer as finished, wake up waiters.
+	 */
+	void
+	transfer_finished();
+
+  private:
+	std::vector<BufferPool::Buffer>		_buffers;
+	std::vector<Shared<Transfer>>		_transfers;
+	RingBuffer							_ring;
+	std::atomic<bool>					_stopping			{ false };
+	std::atomic<std::size_t>			_in_flight			{ 0 };
+	std::atomic<int>					_error				{ LIBUSB_SUCCESS };
+	std::atomic<bool>					_consumer_waiting	{ false };
+	std::mutex							_mutex;
+	std::condition_variable				_state_changed;
+	// Written by the event handling thread only:
+	std::atomic<uint64_t>				_transfers_count	{ 0 };
+	std::atomic<uint64_t>				_bytes				{ 0 };
+	std::atomic<uint64_t>				_overflows			{ 0 };
+	std::atomic<uint64_t>				_bytes_dropped		{ 0 };
+};
+
+
+inline bool
+BulkInStream::running() const noexcept
+{
+	return _in_flight.load() > 0;
+}
+
+
+inline std::size_t
+BulkInStream::available() const noexcept
+{
+	return _ring.read_available();
+}
+
+
+inline std::size_t
+BulkInStream::read (Span<uint8_t> buffer) noexcept
+{
+	return _ring.read (buffer);
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,328 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "bulk_out_stream.h"
+
+
+namespace libusb {
+
+BulkOutStream::BulkOutStream (Device const& device, uint8_t endpoint, std::size_t transfer_size, std::size_t queue_depth, std::size_t queue_capacity,
+							  Shared<BufferPool> pool):
+	_endpoint (endpoint & ~LIBUSB_ENDPOINT_IN),
+	_transfer_size (transfer_size),
+	_slots (queue_depth),
+	_queue (queue_capacity)
+{
+	if (!pool)
+		pool = BufferPool::create (device, transfer_size, BufferPool::Memory::Heap);
+	else if (pool->buffer_size() < transfer_size)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_idle.reserve (queue_depth);
+
+	for (auto& slot: _slots)
+	{
+		auto slot_ptr = &slot;
+		slot.buffer = pool->acquire();
+		slot.transfer = Transfer::create (device);
+		slot.callback = [this, slot_ptr](Transfer&) { handle_completion (*slot_ptr); };
+		_idle.push_back (slot_ptr);
+	}
+}
+
+
+BulkOutStream::BulkOutStream (Device const& device, uint8_t endpoint, TransferPolicy const& policy, std::size_t queue_capacity,
+							  Shared<BufferPool> pool):
+	BulkOutStream (device, endpoint, policy.transfer_size(), policy.queue_depth(), queue_capacity, pool)
+{ }
+
+
+BulkOutStream::~BulkOutStream()
+{
+	stop();
+}
+
+
+std::size_t
+BulkOutStream::try_write (Span<uint8_t const> data)
+{
+	check_state();
+
+	std::size_t written;
+	{
+		std::lock_guard<std::mutex> lock (_write_mutex);
+		written = _queue.write (data);
+	}
+
+	if (written > 0)
+		submit_idle();
+
+	return written;
+}
+
+
+void
+BulkOutStream::write (Span<uint8_t const> data)
+{
+	std::size_t done = 0;
+
+	while (done < data.size())
+	{
+		done += try_write (data.subspan (done, data.size() - done));
+
+		if (done < data.size())
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			// Seq-cst increment pairs with the fences in handle_completion() and submit_idle():
+			++_waiting;
+			_state_changed.wait (lock, [this] { return _queue.write_available() > 0 || _error.load() != LIBUSB_SUCCESS || _stopping.load(); });
+			--_waiting;
+		}
+	}
+}
+
+
+std::size_t
+BulkOutStream::write (Span<uint8_t const> data, std::chrono::milliseconds timeout)
+{
+	auto const deadline = std::chrono::steady_clock::now() + timeout;
+	std::size_t done = 0;
+
+	while (done < data.size())
+	{
+		done += try_write (data.subspan (done, data.size() - done));
+
+		if (done < data.size())
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			++_waiting;
+			bool ready = _state_changed.wait_until (lock, deadline, [this] { return _queue.write_available() > 0 || _error.load() != LIBUSB_SUCCESS || _stopping.load(); });
+			--_waiting;
+
+			if (!ready)
+				break;
+		}
+	}
+
+	return done;
+}
+
+
+void
+BulkOutStream::flush()
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	++_waiting;
+	_state_changed.wait (lock, [this] {
+		return (_queue.read_available() == 0 && _in_flight.load() == 0) || _error.load() != LIBUSB_SUCCESS || _stopping.load();
+	});
+	--_waiting;
+}
+
+
+void
+BulkOutStream::stop()
+{
+	_stopping = true;
+	notify();
+
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	// A callback that checked _stopping just before it was set may still resubmit
+	// its transfer, so keep cancelling until all are done:
+	do {
+		for (auto& slot: _slots)
+			slot.transfer->cancel();
+	}
+	while (!_state_changed.wait_for (lock, std::chrono::milliseconds (10), [this] { return _in_flight.load() == 0; }));
+}
+
+
+Optional<libusb_error>
+BulkOutStream::error() const noexcept
+{
+	auto error = static_cast<libusb_error> (_error.load());
+
+	if (error == LIBUSB_SUCCESS)
+		return { };
+	else
+		return error;
+}
+
+
+BulkOutStream::Statistics
+BulkOutStream::statistics() const noexcept
+{
+	Statistics result;
+	result.transfers = _transfers_count.load (std::memory_order_relaxed);
+	result.bytes = _bytes.load (std::memory_order_relaxed);
+	result.underruns = _underruns.load (std::memory_order_relaxed);
+	return result;
+}
+
+
+void
+BulkOutStream::check_state() const
+{
+	auto error = _error.load();
+
+	if (error != LIBUSB_SUCCESS)
+		throw StatusException (static_cast<libusb_error> (error));
+
+	if (_stopping.load())
+		throw StatusException (LIBUSB_ERROR_INTERRUPTED);
+}
+
+
+void
+BulkOutStream::submit_idle()
+{
+	bool refilled = false;
+
+	{
+		std::lock_guard<std::mutex> lock (_refill_mutex);
+
+		while (!_idle.empty() && !_stopping.load() && _error.load() == LIBUSB_SUCCESS)
+		{
+			bool submitted = false;
+			++_in_flight;
+
+			try {
+				submitted = refill (*_idle.back());
+			}
+			catch (StatusException const& e)
+			{
+				_error = e.status();
+			}
+
+			if (!submitted)
+			{
+				transfer_finished();
+				break;
+			}
+
+			_idle.pop_back();
+			refilled = true;
+		}
+	}
+
+	if (refilled)
+	{
+		// Refilling freed space in the queue, wake up writers like handle_completion() does:
+		std::atomic_thread_fence (std::memory_order_seq_cst);
+
+		if (_waiting.load() > 0)
+			notify();
+	}
+}
+
+
+bool
+BulkOutStream::refill (Slot& slot)
+{
+	auto const n = _queue.read (Span<uint8_t> (slot.buffer.data(), _transfer_size));
+
+	if (n == 0)
+		return false;
+
+	slot.transfer->fill_bulk_write (_endpoint, Span<uint8_t const> (slot.buffer.data(), n));
+	slot.transfer->submit (slot.callback);
+	return true;
+}
+
+
+void
+BulkOutStream::handle_completion (Slot& slot)
+{
+	auto& transfer = *slot.transfer;
+
+	switch (transfer.status())
+	{
+		case TransferStatus::Completed:
+			_transfers_count.fetch_add (1, std::memory_order_relaxed);
+			_bytes.fetch_add (transfer.actual_length(), std::memory_order_relaxed);
+			break;
+
+		case TransferStatus::Cancelled:
+			break;
+
+		default:
+			// Stall, timeout, disconnection: stop the stream and report the error:
+			_error = to_error (transfer.status());
+			break;
+	}
+
+	bool submitted = false;
+
+	if (!_stopping.load() && _error.load() == LIBUSB_SUCCESS)
+	{
+		std::lock_guard<std::mutex> lock (_refill_mutex);
+
+		try {
+			submitted = refill (slot);
+		}
+		catch (StatusException const& e)
+		{
+			_error = e.status();
+		}
+
+		if (!submitted)
+		{
+			_idle.push_back (&slot);
+
+			// This was the last transfer in flight, so the link goes idle:
+			if (_in_flight.load() == 1 && _error.load() == LIBUSB_SUCCESS)
+				_underruns.fetch_add (1, std::memory_order_relaxed);
+		}
+	}
+
+	if (!submitted)
+		transfer_finished();
+	else
+	{
+		// Refilling freed space in the queue. Seq-cst fence pairs with
+		// the increment of _waiting in write():
+		std::atomic_thread_fence (std::memory_order_seq_cst);
+
+		if (_waiting.load() > 0)
+			notify();
+	}
+}
+
+
+void
+BulkOutStream::transfer_finished()
+{
+	// Notify under the mutex, so that a waiter can't miss it between
+	// checking the predicate and going to sleep:
+	std::lock_guard<std::mutex> lock (_mutex);
+	--_in_flight;
+	_state_changed.notify_all();
+}
+
+
+void
+BulkOutStream::notify()
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	_state_changed.notify_all();
+}
+
+} // namespace libusb
@@ -0,0 +1,242 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__BULK_OUT_STREAM_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__BULK_OUT_STREAM_H__INCLUDED
+
+// Standard:
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "buffer_pool.h"
+#include "ring_buffer.h"
+#include "transfer.h"
+#include "transfer_policy.h"
+
+
+namespace libusb {
+
+/**
+ * Continuous writing to a bulk OUT endpoint.
+ *
+ * Producer threads append data to a bounded queue. Up to queue_depth
+ * transfers are kept in flight; each one is refilled from the queue and
+ * resubmitted from its completion callback, so the link doesn't idle while
+ * data is available. When the queue is full, write() blocks and try_write()
+ * accepts only what fits.
+ *
+ * An underrun is counted whenever the last in-flight transfer completes
+ * and the queue is empty, ie. the link goes idle waiting for producers.
+ *
+ * Completion callbacks run in the thread handling libusb events, which must
+ * be running (see Bus::acquire_event_thread()).
+ */
+class BulkOutStream
+{
+  public:
+	class Statistics
+	{
+	  public:
+		// Completed transfers:
+		uint64_t	transfers	= 0;
+		// Bytes sent to the device:
+		uint64_t	bytes		= 0;
+		// Times the link went idle because the queue was empty:
+		uint64_t	underruns	= 0;
+	};
+
+  public:
+	/**
+	 * Ctor
+	 *
+	 * \param	endpoint
+	 * 			Endpoint address. The direction bit is cleared.
+	 * \param	transfer_size
+	 * 			Max. size of a single transfer. Transfers are submitted with
+	 * 			whatever is queued, up to this size.
+	 * \param	queue_depth
+	 * 			Max. number of transfers in flight.
+	 * \param	queue_capacity
+	 * 			Size of the queue in bytes.
+	 * \param	pool
+	 * 			Pool to take transfer buffers from, eg. to use device memory.
+	 * 			Its buffer_size() must be at least transfer_size. If null,
+	 * 			buffers are allocated on the heap.
+	 */
+	explicit BulkOutStream (Device const&, uint8_t endpoint, std::size_t transfer_size, std::size_t queue_depth, std::size_t queue_capacity,
+							Shared<BufferPool> pool = nullptr);
+
+	/**
+	 * Ctor
+	 * Take transfer size and queue depth from the policy.
+	 */
+	explicit BulkOutStream (Device const&, uint8_t endpoint, TransferPolicy const&, std::size_t queue_capacity,
+							Shared<BufferPool> pool = nullptr);
+
+	BulkOutStream (BulkOutStream const&) = delete;
+
+	// Dtor
+	~BulkOutStream();
+
+	BulkOutStream&
+	operator= (BulkOutStream const&) = delete;
+
+	/**
+	 * Queue as much of data as fits without blocking.
+	 * Return number of bytes queued. Throws StatusException if the stream
+	 * has failed (see error()) or LIBUSB_ERROR_INTERRUPTED if it was stopped.
+	 */
+	std::size_t
+	try_write (Span<uint8_t const> data);
+
+	/**
+	 * Queue all of data, blocking while the queue is full.
+	 * Throws like try_write().
+	 */
+	void
+	write (Span<uint8_t const> data);
+
+	/**
+	 * Like write(), but give up after timeout.
+	 * Return number of bytes queued.
+	 */
+	std::size_t
+	write (Span<uint8_t const> data, std::chrono::milliseconds timeout);
+
+	/**
+	 * Block until all queued data has been sent, or the stream has failed
+	 * or has been stopped.
+	 */
+	void
+	flush();
+
+	/**
+	 * Cancel in-flight transfers and block until they have completed.
+	 * Data still queued is not sent. Must not be called from the thread
+	 * handling libusb events.
+	 */
+	void
+	stop();
+
+	/**
+	 * Return number of bytes queued and not yet submitted.
+	 */
+	std::size_t
+	queued() const noexcept;
+
+	/**
+	 * Return error that stopped the stream, if any.
+	 */
+	Optional<libusb_error>
+	error() const noexcept;
+
+	/**
+	 * Return transfer and underrun counters.
+	 */
+	Statistics
+	statistics() const noexcept;
+
+  private:
+	/**
+	 * Transfer with its buffer.
+	 */
+	class Slot
+	{
+	  public:
+		BufferPool::Buffer		buffer;
+		Shared<Transfer>		transfer;
+		// Built once, so that resubmitting doesn't allocate:
+		Transfer::Callback		callback;
+	};
+
+  private:
+	/**
+	 * Throw if the stream doesn't accept data anymore.
+	 */
+	void
+	check_state() const;
+
+	/**
+	 * Submit idle transfers if there's queued data.
+	 */
+	void
+	submit_idle();
+
+	/**
+	 * Fill transfer from the queue and submit it. Return false if the queue
+	 * was empty and the transfer wasn't submitted.
+	 * Must be called with _refill_mutex locked.
+	 */
+	bool
+	refill (Slot&);
+
+	/**
+	 * Transfer completion callback.
+	 */
+	void
+	handle_completion (Slot&);
+
+	/**
+	 * Decrement number of transfers in flight, wake up waiters.
+	 */
+	void
+	transfer_finished();
+
+	/**
+	 * Wake up threads blocked in write() or flush().
+	 */
+	void
+	notify();
+
+  private:
+	uint8_t							_endpoint;
+	std::size_t						_transfer_size;
+	// Not resized after construction, so Slot pointers stay valid:
+	std::vector<Slot>				_slots;
+	RingBuffer						_queue;
+	// Serializes producers (writing side of the queue):
+	std::mutex						_write_mutex;
+	// Serializes refilling (reading side of the queue) and guards _idle:
+	std::mutex						_refill_mutex;
+	std::vector<Slot*>				_idle;
+	std::atomic<bool>				_stopping			{ false };
+	std::atomic<std::size_t>		_in_flight			{ 0 };
+	std::atomic<int>				_error				{ LIBUSB_SUCCESS };
+	std::atomic<std::size_t>		_waiting			{ 0 };
+	std::mutex						_mutex;
+	std::condition_variable			_state_changed;
+	std::atomic<uint64_t>			_transfers_count	{ 0 };
+	std::atomic<uint64_t>			_bytes				{ 0 };
+	std::atomic<uint64_t>			_underruns			{ 0 };
+};
+
+
+inline std::size_t
+BulkOutStream::queued() const noexcept
+{
+	return _queue.read_available();
+}
+
+} // namespace libusb
+
+#endif
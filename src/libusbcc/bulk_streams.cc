@@ -0,0 +1,47 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <utility>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "bulk_streams.h"
+
+
+namespace libusb {
+
+BulkStreams::BulkStreams (Device const& device, uint32_t num_streams, std::vector<uint8_t> endpoints):
+	_handle (device._handle),
+	_endpoints (std::move (endpoints))
+{
+	if (!_handle || _endpoints.empty() || num_streams == 0)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	int result = libusb_alloc_streams (_handle->get(), num_streams, _endpoints.data(), static_cast<int> (_endpoints.size()));
+
+	if (is_error (result))
+		throw StatusException (static_cast<libusb_error> (result));
+
+	_count = static_cast<uint32_t> (result);
+}
+
+
+BulkStreams::~BulkStreams()
+{
+	libusb_free_streams (_handle->get(), _endpoints.data(), static_cast<int> (_endpoints.size()));
+}
+
+} // namespace libusb
@@ -0,0 +1,105 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+
+#ifndef MULABS_ORG__LIBUSBCC__BULK_STREAMS_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__BULK_STREAMS_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * USB 3.0 bulk streams allocated on a set of bulk endpoints: RAII-style
+ * wrapper for libusb_alloc_streams() + libusb_free_streams().
+ *
+ * Streams let many transfers be outstanding on one endpoint at the same time,
+ * each one on its own stream, matched by the device by stream ID (as in UAS).
+ * Submit them with Transfer::fill_bulk_stream_read() and fill_bulk_stream_write(),
+ * using IDs 1…count().
+ *
+ * Streams are supported by SuperSpeed devices only, and only on endpoints
+ * whose SSEndpointCompanion::max_streams() is non-zero. Keeps the device
+ * handle open; all transfers using the streams should be finished before
+ * the object is destroyed.
+ */
+class BulkStreams
+{
+  public:
+	/**
+	 * Ctor
+	 * Throws StatusException if streams can't be allocated.
+	 *
+	 * \param	num_streams
+	 * 			Requested number of streams. The host controller may
+	 * 			allocate fewer, see count().
+	 * \param	endpoints
+	 * 			Addresses of bulk endpoints (including the direction bit)
+	 * 			to allocate streams on. Usually an In and Out endpoint pair.
+	 */
+	explicit BulkStreams (Device const&, uint32_t num_streams, std::vector<uint8_t> endpoints);
+
+	BulkStreams (BulkStreams const&) = delete;
+
+	// Dtor
+	~BulkStreams();
+
+	BulkStreams&
+	operator= (BulkStreams const&) = delete;
+
+	/**
+	 * Return number of allocated streams.
+	 * Valid stream IDs are 1…count().
+	 */
+	uint32_t
+	count() const noexcept;
+
+	/**
+	 * Return endpoints the streams were allocated on.
+	 */
+	std::vector<uint8_t> const&
+	endpoints() const noexcept;
+
+  private:
+	Shared<low_level::DeviceHandle>	_handle;
+	std::vector<uint8_t>			_endpoints;
+	uint32_t						_count	= 0;
+};
+
+
+inline uint32_t
+BulkStreams::count() const noexcept
+{
+	return _count;
+}
+
+
+inline std::vector<uint8_t> const&
+BulkStreams::endpoints() const noexcept
+{
+	return _endpoints;
+}
+
+} // namespace libusb
+
+#endif
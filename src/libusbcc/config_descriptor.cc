@@ -0,0 +1,121 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "config_descriptor.h"
+
+
+namespace libusb {
+
+SSEndpointCompanion::SSEndpointCompanion (libusb_ss_endpoint_companion_descriptor const& descriptor, TransferType transfer_type):
+	_max_burst (descriptor.bMaxBurst + 1),
+	_max_streams (0),
+	_mult (1),
+	_bytes_per_interval (descriptor.wBytesPerInterval)
+{
+	switch (transfer_type)
+	{
+		case TransferType::Bulk:
+			// MaxStreams is bits 0…4, number of streams is 2^MaxStreams:
+			if (auto max_streams = descriptor.bmAttributes & 0x1f)
+				_max_streams = uint32_t (1) << max_streams;
+			break;
+
+		case TransferType::Isochronous:
+			// Mult is bits 0…1:
+			_mult = (descriptor.bmAttributes & 0x03) + 1;
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+Optional<Endpoint>
+AltSetting::find_endpoint (uint8_t address) const noexcept
+{
+	for (auto endpoint: endpoints())
+		if (endpoint.address() == address)
+			return endpoint;
+
+	return { };
+}
+
+
+ConfigDescriptor::ConfigDescriptor (libusb_config_descriptor* descriptor):
+	_descriptor (descriptor)
+{
+	_endpoints.fill (nullptr);
+
+	for (auto interface: interfaces())
+		for (auto alt_setting: interface.alt_settings())
+			for (auto endpoint: alt_setting.endpoints())
+			{
+				auto& slot = _endpoints[endpoint_slot (endpoint.address())];
+
+				if (!slot)
+					slot = &endpoint.get_libusb_descriptor();
+
+				// Companion descriptor, if any, is stored in extra bytes:
+				if (endpoint.get_libusb_descriptor().extra_length > 0)
+				{
+					libusb_ss_endpoint_companion_descriptor* companion;
+
+					if (libusb_get_ss_endpoint_companion_descriptor (nullptr, &endpoint.get_libusb_descriptor(), &companion) == LIBUSB_SUCCESS)
+					{
+						_ss_endpoint_companions.emplace (&endpoint.get_libusb_descriptor(), SSEndpointCompanion (*companion, endpoint.transfer_type()));
+						libusb_free_ss_endpoint_companion_descriptor (companion);
+					}
+				}
+			}
+}
+
+
+ConfigDescriptor::~ConfigDescriptor()
+{
+	libusb_free_config_descriptor (_descriptor);
+}
+
+
+std::size_t
+ConfigDescriptor::burst_size (Endpoint const& endpoint) const noexcept
+{
+	std::size_t packets;
+
+	if (auto companion = ss_endpoint_companion (endpoint))
+		packets = companion->max_burst() * companion->mult();
+	else
+		packets = endpoint.transactions_per_microframe();
+
+	return endpoint.max_packet_size() * packets;
+}
+
+
+std::size_t
+ConfigDescriptor::aligned_transfer_size (Endpoint const& endpoint, std::size_t requested_size) const noexcept
+{
+	std::size_t burst = burst_size (endpoint);
+
+	if (burst == 0)
+		return requested_size;
+	else if (requested_size <= burst)
+		return burst;
+	else
+		return (requested_size + burst - 1) / burst * burst;
+}
+
+} // namespace libusb
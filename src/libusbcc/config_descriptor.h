@@ -0,0 +1,677 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__CONFIG_DESCRIPTOR_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__CONFIG_DESCRIPTOR_H__INCLUDED
+
+// Standard:
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <unordered_map>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * Iterable view over a C array of libusb descriptors.
+ * Yields View objects constructed from pointers to array elements,
+ * nothing is copied.
+ */
+template<class View, class Raw>
+	class DescriptorRange
+	{
+	  public:
+		class Iterator
+		{
+		  public:
+			typedef std::forward_iterator_tag	iterator_category;
+			typedef View						value_type;
+			typedef std::ptrdiff_t				difference_type;
+			typedef View const*					pointer;
+			typedef View const&					reference;
+
+		  public:
+			// Ctor
+			explicit
+			Iterator (Raw const* position) noexcept:
+				_position (position),
+				_view (position)
+			{ }
+
+			View const&
+			operator*() const noexcept
+			{
+				return _view;
+			}
+
+			View const*
+			operator->() const noexcept
+			{
+				return &_view;
+			}
+
+			Iterator&
+			operator++() noexcept
+			{
+				_view = View (++_position);
+				return *this;
+			}
+
+			Iterator
+			operator++ (int) noexcept
+			{
+				Iterator copy = *this;
+				++*this;
+				return copy;
+			}
+
+			difference_type
+			operator- (Iterator const& other) const noexcept
+			{
+				return _position - other._position;
+			}
+
+			bool
+			operator== (Iterator const& other) const noexcept
+			{
+				return _position == other._position;
+			}
+
+			bool
+			operator!= (Iterator const& other) const noexcept
+			{
+				return _position != other._position;
+			}
+
+		  private:
+			Raw const*	_position;
+			// Views only hold a pointer, so it's fine to keep one for the end position too:
+			View		_view;
+		};
+
+	  public:
+		// Ctor
+		explicit
+		DescriptorRange (Raw const* array, std::size_t size) noexcept:
+			_array (array),
+			_size (size)
+		{ }
+
+		Iterator
+		begin() const noexcept
+		{
+			return Iterator (_array);
+		}
+
+		Iterator
+		end() const noexcept
+		{
+			return Iterator (_array + _size);
+		}
+
+		std::size_t
+		size() const noexcept
+		{
+			return _size;
+		}
+
+		bool
+		empty() const noexcept
+		{
+			return _size == 0;
+		}
+
+		View
+		operator[] (std::size_t index) const noexcept
+		{
+			return View (_array + index);
+		}
+
+	  private:
+		Raw const*	_array;
+		std::size_t	_size;
+	};
+
+
+/**
+ * Non-owning view of libusb_endpoint_descriptor.
+ * Valid for as long as the ConfigDescriptor it was obtained from.
+ */
+class Endpoint
+{
+  public:
+	// Ctor
+	explicit Endpoint (libusb_endpoint_descriptor const*) noexcept;
+
+	/**
+	 * Return endpoint address (bEndpointAddress), including the direction bit.
+	 */
+	uint8_t
+	address() const noexcept;
+
+	/**
+	 * Return endpoint number (without the direction bit).
+	 */
+	uint8_t
+	number() const noexcept;
+
+	/**
+	 * Return transfer direction.
+	 */
+	Direction
+	direction() const noexcept;
+
+	/**
+	 * Return transfer type.
+	 */
+	TransferType
+	transfer_type() const noexcept;
+
+	/**
+	 * Return max. packet size (bits 0…10 of wMaxPacketSize).
+	 */
+	uint16_t
+	max_packet_size() const noexcept;
+
+	/**
+	 * Return number of transactions per microframe for high-speed
+	 * isochronous and interrupt endpoints (1…3, from bits 11…12 of wMaxPacketSize).
+	 */
+	uint8_t
+	transactions_per_microframe() const noexcept;
+
+	/**
+	 * Return polling interval (bInterval).
+	 */
+	uint8_t
+	interval() const noexcept;
+
+	/**
+	 * Return the underlying libusb descriptor.
+	 */
+	libusb_endpoint_descriptor const&
+	get_libusb_descriptor() const noexcept;
+
+  private:
+	libusb_endpoint_descriptor const* _descriptor;
+};
+
+
+typedef DescriptorRange<Endpoint, libusb_endpoint_descriptor> Endpoints;
+
+
+/**
+ * Parsed SuperSpeed Endpoint Companion descriptor.
+ * Present on endpoints of SuperSpeed devices only.
+ */
+class SSEndpointCompanion
+{
+  public:
+	// Ctor
+	explicit SSEndpointCompanion (libusb_ss_endpoint_companion_descriptor const&, TransferType);
+
+	/**
+	 * Return max. number of packets the endpoint can send or receive
+	 * as part of a burst (bMaxBurst + 1, that is 1…16).
+	 */
+	uint8_t
+	max_burst() const noexcept;
+
+	/**
+	 * Return max. number of bulk streams supported by the endpoint.
+	 * 0 means streams are not supported (or it's not a bulk endpoint).
+	 */
+	uint32_t
+	max_streams() const noexcept;
+
+	/**
+	 * Return max. number of bursts within a service interval for
+	 * isochronous endpoints (1…3). 1 for other endpoint types.
+	 */
+	uint8_t
+	mult() const noexcept;
+
+	/**
+	 * Return total number of bytes the periodic endpoint transfers
+	 * every service interval (wBytesPerInterval).
+	 */
+	uint16_t
+	bytes_per_interval() const noexcept;
+
+  private:
+	uint8_t		_max_burst;
+	uint32_t	_max_streams;
+	uint8_t		_mult;
+	uint16_t	_bytes_per_interval;
+};
+
+
+/**
+ * Non-owning view of libusb_interface_descriptor.
+ * Valid for as long as the ConfigDescriptor it was obtained from.
+ */
+class AltSetting
+{
+  public:
+	// Ctor
+	explicit AltSetting (libusb_interface_descriptor const*) noexcept;
+
+	/**
+	 * Return interface number (bInterfaceNumber).
+	 */
+	uint8_t
+	interface_number() const noexcept;
+
+	/**
+	 * Return alternate setting number (bAlternateSetting).
+	 */
+	uint8_t
+	alternate_setting() const noexcept;
+
+	/**
+	 * Return interface class (bInterfaceClass).
+	 */
+	uint8_t
+	interface_class() const noexcept;
+
+	/**
+	 * Return interface sub-class (bInterfaceSubClass).
+	 */
+	uint8_t
+	interface_sub_class() const noexcept;
+
+	/**
+	 * Return interface protocol (bInterfaceProtocol).
+	 */
+	uint8_t
+	interface_protocol() const noexcept;
+
+	/**
+	 * Return endpoints of this alternate setting.
+	 */
+	Endpoints
+	endpoints() const noexcept;
+
+	/**
+	 * Find endpoint with given address (including the direction bit).
+	 */
+	Optional<Endpoint>
+	find_endpoint (uint8_t address) const noexcept;
+
+	/**
+	 * Return the underlying libusb descriptor.
+	 */
+	libusb_interface_descriptor const&
+	get_libusb_descriptor() const noexcept;
+
+  private:
+	libusb_interface_descriptor const* _descriptor;
+};
+
+
+typedef DescriptorRange<AltSetting, libusb_interface_descriptor> AltSettings;
+
+
+/**
+ * Non-owning view of libusb_interface.
+ * Valid for as long as the ConfigDescriptor it was obtained from.
+ */
+class Interface
+{
+  public:
+	// Ctor
+	explicit Interface (libusb_interface const*) noexcept;
+
+	/**
+	 * Return alternate settings of this interface.
+	 */
+	AltSettings
+	alt_settings() const noexcept;
+
+	/**
+	 * Return interface number.
+	 */
+	uint8_t
+	number() const noexcept;
+
+  private:
+	libusb_interface const* _interface;
+};
+
+
+typedef DescriptorRange<Interface, libusb_interface> Interfaces;
+
+
+/**
+ * RAII-style class for libusb_get_config_descriptor() + libusb_free_config_descriptor().
+ * Obtain it with DeviceDescriptor::config_descriptor(), which caches it.
+ */
+class ConfigDescriptor
+{
+  public:
+	/**
+	 * Ctor
+	 * Takes ownership of the libusb descriptor.
+	 */
+	explicit ConfigDescriptor (libusb_config_descriptor*);
+
+	ConfigDescriptor (ConfigDescriptor const&) = delete;
+
+	// Dtor
+	~ConfigDescriptor();
+
+	ConfigDescriptor&
+	operator= (ConfigDescriptor const&) = delete;
+
+	/**
+	 * Return configuration value (bConfigurationValue).
+	 */
+	uint8_t
+	configuration_value() const noexcept;
+
+	/**
+	 * Return max. power consumption in device-specific units (MaxPower).
+	 */
+	uint8_t
+	max_power() const noexcept;
+
+	/**
+	 * Return interfaces of this configuration.
+	 */
+	Interfaces
+	interfaces() const noexcept;
+
+	/**
+	 * Find endpoint with given address (including the direction bit).
+	 * O(1), the lookup table is built in ctor. If the endpoint appears
+	 * in multiple alternate settings, the first one is returned; use
+	 * AltSetting::find_endpoint() to look in a specific one.
+	 */
+	Optional<Endpoint>
+	find_endpoint (uint8_t address) const noexcept;
+
+	/**
+	 * Return SuperSpeed Endpoint Companion descriptor of given endpoint.
+	 * Parsed in ctor. Return nullptr if the endpoint doesn't have one.
+	 */
+	SSEndpointCompanion const*
+	ss_endpoint_companion (Endpoint const&) const noexcept;
+
+	/**
+	 * Return number of bytes the endpoint transfers in a single burst:
+	 * max. packet size times the number of packets per burst (SuperSpeed)
+	 * or transactions per microframe (high-speed high-bandwidth).
+	 */
+	std::size_t
+	burst_size (Endpoint const&) const noexcept;
+
+	/**
+	 * Return transfer size rounded up to the multiple of burst_size(),
+	 * so that no transfer ends with a partial burst.
+	 */
+	std::size_t
+	aligned_transfer_size (Endpoint const&, std::size_t requested_size) const noexcept;
+
+	/**
+	 * Return the underlying libusb descriptor.
+	 */
+	libusb_config_descriptor const&
+	get_libusb_descriptor() const noexcept;
+
+  private:
+	/**
+	 * Return index in _endpoints for given endpoint address.
+	 */
+	static std::size_t
+	endpoint_slot (uint8_t address) noexcept;
+
+  private:
+	libusb_config_descriptor*							_descriptor;
+	// 16 OUT endpoints followed by 16 IN endpoints:
+	std::array<libusb_endpoint_descriptor const*, 32>	_endpoints;
+	std::unordered_map<libusb_endpoint_descriptor const*, SSEndpointCompanion>
+														_ss_endpoint_companions;
+};
+
+
+inline
+Endpoint::Endpoint (libusb_endpoint_descriptor const* descriptor) noexcept:
+	_descriptor (descriptor)
+{ }
+
+
+inline uint8_t
+Endpoint::address() const noexcept
+{
+	return _descriptor->bEndpointAddress;
+}
+
+
+inline uint8_t
+Endpoint::number() const noexcept
+{
+	return _descriptor->bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK;
+}
+
+
+inline Direction
+Endpoint::direction() const noexcept
+{
+	return static_cast<Direction> (_descriptor->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK);
+}
+
+
+inline TransferType
+Endpoint::transfer_type() const noexcept
+{
+	return static_cast<TransferType> (_descriptor->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK);
+}
+
+
+inline uint16_t
+Endpoint::max_packet_size() const noexcept
+{
+	return _descriptor->wMaxPacketSize & 0x07ff;
+}
+
+
+inline uint8_t
+Endpoint::transactions_per_microframe() const noexcept
+{
+	return ((_descriptor->wMaxPacketSize >> 11) & 0x03) + 1;
+}
+
+
+inline uint8_t
+Endpoint::interval() const noexcept
+{
+	return _descriptor->bInterval;
+}
+
+
+inline libusb_endpoint_descriptor const&
+Endpoint::get_libusb_descriptor() const noexcept
+{
+	return *_descriptor;
+}
+
+
+inline uint8_t
+SSEndpointCompanion::max_burst() const noexcept
+{
+	return _max_burst;
+}
+
+
+inline uint32_t
+SSEndpointCompanion::max_streams() const noexcept
+{
+	return _max_streams;
+}
+
+
+inline uint8_t
+SSEndpointCompanion::mult() const noexcept
+{
+	return _mult;
+}
+
+
+inline uint16_t
+SSEndpointCompanion::bytes_per_interval() const noexcept
+{
+	return _bytes_per_interval;
+}
+
+
+inline
+AltSetting::AltSetting (libusb_interface_descriptor const* descriptor) noexcept:
+	_descriptor (descriptor)
+{ }
+
+
+inline uint8_t
+AltSetting::interface_number() const noexcept
+{
+	return _descriptor->bInterfaceNumber;
+}
+
+
+inline uint8_t
+AltSetting::alternate_setting() const noexcept
+{
+	return _descriptor->bAlternateSetting;
+}
+
+
+inline uint8_t
+AltSetting::interface_class() const noexcept
+{
+	return _descriptor->bInterfaceClass;
+}
+
+
+inline uint8_t
+AltSetting::interface_sub_class() const noexcept
+{
+	return _descriptor->bInterfaceSubClass;
+}
+
+
+inline uint8_t
+AltSetting::interface_protocol() const noexcept
+{
+	return _descriptor->bInterfaceProtocol;
+}
+
+
+inline Endpoints
+AltSetting::endpoints() const noexcept
+{
+	return Endpoints (_descriptor->endpoint, _descriptor->bNumEndpoints);
+}
+
+
+inline libusb_interface_descriptor const&
+AltSetting::get_libusb_descriptor() const noexcept
+{
+	return *_descriptor;
+}
+
+
+inline
+Interface::Interface (libusb_interface const* interface) noexcept:
+	_interface (interface)
+{ }
+
+
+inline AltSettings
+Interface::alt_settings() const noexcept
+{
+	return AltSettings (_interface->altsetting, _interface->num_altsetting);
+}
+
+
+inline uint8_t
+Interface::number() const noexcept
+{
+	return _interface->num_altsetting > 0 ? _interface->altsetting[0].bInterfaceNumber : 0;
+}
+
+
+inline uint8_t
+ConfigDescriptor::configuration_value() const noexcept
+{
+	return _descriptor->bConfigurationValue;
+}
+
+
+inline uint8_t
+ConfigDescriptor::max_power() const noexcept
+{
+	return _descriptor->MaxPower;
+}
+
+
+inline Interfaces
+ConfigDescriptor::interfaces() const noexcept
+{
+	return Interfaces (_descriptor->interface, _descriptor->bNumInterfaces);
+}
+
+
+inline Optional<Endpoint>
+ConfigDescriptor::find_endpoint (uint8_t address) const noexcept
+{
+	if (auto endpoint = _endpoints[endpoint_slot (address)])
+		return Endpoint (endpoint);
+	else
+		return { };
+}
+
+
+inline SSEndpointCompanion const*
+ConfigDescriptor::ss_endpoint_companion (Endpoint const& endpoint) const noexcept
+{
+	auto found = _ss_endpoint_companions.find (&endpoint.get_libusb_descriptor());
+
+	if (found != _ss_endpoint_companions.end())
+		return &found->second;
+	else
+		return nullptr;
+}
+
+
+inline libusb_config_descriptor const&
+ConfigDescriptor::get_libusb_descriptor() const noexcept
+{
+	return *_descriptor;
+}
+
+
+inline std::size_t
+ConfigDescriptor::endpoint_slot (uint8_t address) noexcept
+{
+	return (address & LIBUSB_ENDPOINT_ADDRESS_MASK) | ((address & LIBUSB_ENDPOINT_DIR_MASK) ? 16 : 0);
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,435 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__COROUTINE_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__COROUTINE_H__INCLUDED
+
+#if !defined(__cpp_impl_coroutine)
+#error "libusbcc/coroutine.h requires C++20 coroutines"
+#endif
+
+// Standard:
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "transfer.h"
+
+
+namespace libusb {
+namespace coro {
+
+/**
+ * Awaitable asynchronous transfer, eg.:
+ *
+ *   std::size_t n = co_await coro::bulk_read (device, 0x81, buffer);
+ *
+ * The transfer is submitted when the coroutine suspends, and the coroutine
+ * is resumed from the completion callback, that is from the thread handling
+ * libusb events (Bus's event thread, asio::EventDriver, …).
+ *
+ * The awaiter lives in the coroutine frame and holds all per-transfer state;
+ * the only allocation is libusb_alloc_transfer() itself (libusb doesn't allow
+ * embedding libusb_transfer), plus the setup packet and data buffer for
+ * control transfers, which is owned by the libusb transfer.
+ *
+ * co_await yields the number of bytes transferred. StatusException is thrown
+ * if the transfer fails, except timeouts after some data was transferred,
+ * which return the partial count.
+ *
+ * Destroying a coroutine suspended on a transfer cancels the transfer and
+ * waits up to CancellationTimeout until libusb reports the cancellation
+ * (it doesn't wait at all if done from within another awaiter's completion).
+ * If the cancellation isn't reported in time, eg. because nobody handles
+ * libusb events, the transfer is abandoned and freed when it eventually
+ * completes; the buffer of a read transfer must stay valid until then.
+ */
+class TransferAwaiter
+{
+  public:
+	// Max. time the dtor waits for cancellation of the transfer:
+	static constexpr std::chrono::milliseconds CancellationTimeout { 200 };
+
+  public:
+	// Ctor for bulk and interrupt transfers
+	explicit TransferAwaiter (Device const&, TransferType, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms);
+
+	// Ctor for control transfers
+	explicit TransferAwaiter (Device const&, ControlTransfer const&, Direction, Span<uint8_t> buffer, int timeout_ms);
+
+	TransferAwaiter (TransferAwaiter const&) = delete;
+
+	// Dtor
+	~TransferAwaiter();
+
+	TransferAwaiter&
+	operator= (TransferAwaiter const&) = delete;
+
+	bool
+	await_ready() const noexcept;
+
+	/**
+	 * Submit the transfer. If submission fails, don't suspend
+	 * and let await_resume() throw.
+	 */
+	bool
+	await_suspend (std::coroutine_handle<>) noexcept;
+
+	std::size_t
+	await_resume();
+
+  private:
+	/**
+	 * Allocate libusb transfer.
+	 */
+	void
+	allocate (Device const&);
+
+	/**
+	 * Callback passed to libusb.
+	 */
+	static void LIBUSB_CALL
+	handle_completion (libusb_transfer*);
+
+	/**
+	 * Callback for transfers abandoned by the dtor. Frees the transfer.
+	 * user_data points to heap-allocated Shared<low_level::DeviceHandle>.
+	 */
+	static void LIBUSB_CALL
+	handle_abandoned_completion (libusb_transfer*);
+
+	/**
+	 * Mutex and condition used by the dtor to wait for cancellation.
+	 * Also serializes abandoning transfers with their completion.
+	 */
+	static std::mutex&
+	cancellation_mutex() noexcept;
+
+	static std::condition_variable&
+	cancellation_condition() noexcept;
+
+	/**
+	 * Return true (for the current thread) while within handle_completion().
+	 */
+	static bool&
+	in_completion() noexcept;
+
+  private:
+	Shared<low_level::DeviceHandle>	_handle;
+	libusb_transfer*				_transfer		= nullptr;
+	Span<uint8_t>					_buffer;
+	bool							_control_in		= false;
+	std::coroutine_handle<>			_coroutine;
+	libusb_error					_submit_error	= LIBUSB_SUCCESS;
+	std::atomic<bool>				_in_flight		{ false };
+	std::atomic<bool>				_abandoned		{ false };
+};
+
+
+inline
+TransferAwaiter::TransferAwaiter (Device const& device, TransferType type, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms):
+	_buffer (buffer)
+{
+	allocate (device);
+
+	if (type == TransferType::Interrupt)
+		libusb_fill_interrupt_transfer (_transfer, _handle->get(), endpoint, buffer.data(), static_cast<int> (buffer.size()),
+										&TransferAwaiter::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+	else
+		libusb_fill_bulk_transfer (_transfer, _handle->get(), endpoint, buffer.data(), static_cast<int> (buffer.size()),
+								   &TransferAwaiter::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+}
+
+
+inline
+TransferAwaiter::TransferAwaiter (Device const& device, ControlTransfer const& ct, Direction direction, Span<uint8_t> buffer, int timeout_ms):
+	_buffer (buffer),
+	_control_in (direction == Direction::In)
+{
+	// wLength is 16-bit:
+	if (buffer.size() > 0xffff)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	allocate (device);
+
+	// Freed together with the transfer, which may outlive the awaiter if abandoned:
+	auto setup = static_cast<uint8_t*> (std::malloc (LIBUSB_CONTROL_SETUP_SIZE + buffer.size()));
+
+	if (!setup)
+	{
+		libusb_free_transfer (_transfer);
+		throw StatusException (LIBUSB_ERROR_NO_MEM);
+	}
+
+	libusb_fill_control_setup (setup, ct.request_type (direction), ct.request, ct.value, ct.index, static_cast<uint16_t> (buffer.size()));
+
+	if (!_control_in)
+		std::copy (buffer.begin(), buffer.end(), setup + LIBUSB_CONTROL_SETUP_SIZE);
+
+	libusb_fill_control_transfer (_transfer, _handle->get(), setup, &TransferAwaiter::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+	_transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+}
+
+
+inline
+TransferAwaiter::~TransferAwaiter()
+{
+	if (_in_flight.load (std::memory_order_acquire))
+	{
+		std::unique_lock<std::mutex> lock (cancellation_mutex());
+
+		_abandoned.store (true, std::memory_order_release);
+		libusb_cancel_transfer (_transfer);
+
+		// Completion would never come while this thread is busy handling events:
+		auto const timeout = in_completion() ? std::chrono::milliseconds (0) : CancellationTimeout;
+
+		if (!cancellation_condition().wait_for (lock, timeout, [this] { return !_in_flight.load (std::memory_order_acquire); }))
+		{
+			// Let libusb free the transfer when it completes. The handle must be kept open until then:
+			_transfer->user_data = new Shared<low_level::DeviceHandle> (_handle);
+			_transfer->callback = &TransferAwaiter::handle_abandoned_completion;
+			_transfer = nullptr;
+		}
+	}
+
+	if (_transfer)
+		libusb_free_transfer (_transfer);
+}
+
+
+inline bool
+TransferAwaiter::await_ready() const noexcept
+{
+	return false;
+}
+
+
+inline bool
+TransferAwaiter::await_suspend (std::coroutine_handle<> coroutine) noexcept
+{
+	_coroutine = coroutine;
+
+	try {
+		_handle->add_in_flight (_transfer);
+	}
+	catch (...)
+	{
+		_submit_error = LIBUSB_ERROR_NO_MEM;
+		return false;
+	}
+
+	_in_flight.store (true, std::memory_order_release);
+	int err = libusb_submit_transfer (_transfer);
+
+	if (is_error (err))
+	{
+		_handle->remove_in_flight (_transfer);
+		_in_flight.store (false, std::memory_order_release);
+		_submit_error = static_cast<libusb_error> (err);
+		return false;
+	}
+
+	return true;
+}
+
+
+inline std::size_t
+TransferAwaiter::await_resume()
+{
+	if (_submit_error != LIBUSB_SUCCESS)
+		throw StatusException (_submit_error);
+
+	auto const status = static_cast<TransferStatus> (_transfer->status);
+	auto const length = std::min<std::size_t> (_transfer->actual_length, _buffer.size());
+
+	// Timed out transfers may still have transferred some data, which would be lost otherwise:
+	if (status != TransferStatus::Completed && !(status == TransferStatus::TimedOut && length > 0))
+		throw StatusException (to_error (status));
+
+	if (_control_in)
+	{
+		auto const data = libusb_control_transfer_get_data (_transfer);
+		std::copy (data, data + length, _buffer.data());
+	}
+
+	return length;
+}
+
+
+inline void
+TransferAwaiter::allocate (Device const& device)
+{
+	if (!device._handle)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	if (_buffer.size() > 0x7fffffff)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_handle = device._handle;
+	_transfer = libusb_alloc_transfer (0);
+
+	if (!_transfer)
+		throw StatusException (LIBUSB_ERROR_NO_MEM);
+}
+
+
+inline void LIBUSB_CALL
+TransferAwaiter::handle_completion (libusb_transfer* transfer)
+{
+	std::unique_lock<std::mutex> lock (cancellation_mutex());
+
+	// The dtor may have given up waiting after libusb picked this callback,
+	// in which case the awaiter is gone:
+	if (transfer->callback != &TransferAwaiter::handle_completion)
+	{
+		lock.unlock();
+		handle_abandoned_completion (transfer);
+		return;
+	}
+
+	auto self = static_cast<TransferAwaiter*> (transfer->user_data);
+	self->_handle->remove_in_flight (transfer);
+	self->_in_flight.store (false, std::memory_order_release);
+
+	if (self->_abandoned.load (std::memory_order_acquire))
+		// The dtor is waiting, self must not be touched after this:
+		cancellation_condition().notify_all();
+	else
+	{
+		lock.unlock();
+
+		bool const was_in_completion = in_completion();
+		in_completion() = true;
+		self->_coroutine.resume();
+		in_completion() = was_in_completion;
+	}
+}
+
+
+inline void LIBUSB_CALL
+TransferAwaiter::handle_abandoned_completion (libusb_transfer* transfer)
+{
+	std::unique_ptr<Shared<low_level::DeviceHandle>> handle (static_cast<Shared<low_level::DeviceHandle>*> (transfer->user_data));
+	(*handle)->remove_in_flight (transfer);
+	libusb_free_transfer (transfer);
+}
+
+
+inline std::mutex&
+TransferAwaiter::cancellation_mutex() noexcept
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+
+inline std::condition_variable&
+TransferAwaiter::cancellation_condition() noexcept
+{
+	static std::condition_variable condition;
+	return condition;
+}
+
+
+inline bool&
+TransferAwaiter::in_completion() noexcept
+{
+	static thread_local bool value = false;
+	return value;
+}
+
+
+/**
+ * Return awaitable bulk transfer from the device. The buffer must stay
+ * valid until the transfer completes.
+ */
+inline TransferAwaiter
+bulk_read (Device const& device, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms = 0)
+{
+	return TransferAwaiter (device, TransferType::Bulk, static_cast<uint8_t> (endpoint | LIBUSB_ENDPOINT_IN), buffer, timeout_ms);
+}
+
+
+/**
+ * Return awaitable bulk transfer to the device. The buffer must stay
+ * valid until the transfer completes.
+ */
+inline TransferAwaiter
+bulk_write (Device const& device, uint8_t endpoint, Span<uint8_t const> buffer, int timeout_ms = 0)
+{
+	// For to-device transfers the buffer is not modified:
+	return TransferAwaiter (device, TransferType::Bulk, endpoint & ~LIBUSB_ENDPOINT_IN,
+							{ const_cast<uint8_t*> (buffer.data()), buffer.size() }, timeout_ms);
+}
+
+
+/**
+ * Return awaitable interrupt transfer from the device.
+ */
+inline TransferAwaiter
+interrupt_read (Device const& device, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms = 0)
+{
+	return TransferAwaiter (device, TransferType::Interrupt, static_cast<uint8_t> (endpoint | LIBUSB_ENDPOINT_IN), buffer, timeout_ms);
+}
+
+
+/**
+ * Return awaitable interrupt transfer to the device.
+ */
+inline TransferAwaiter
+interrupt_write (Device const& device, uint8_t endpoint, Span<uint8_t const> buffer, int timeout_ms = 0)
+{
+	// For to-device transfers the buffer is not modified:
+	return TransferAwaiter (device, TransferType::Interrupt, endpoint & ~LIBUSB_ENDPOINT_IN,
+							{ const_cast<uint8_t*> (buffer.data()), buffer.size() }, timeout_ms);
+}
+
+
+/**
+ * Return awaitable control transfer from the device (In direction,
+ * regardless of ct.direction). wLength is the size of the buffer.
+ */
+inline TransferAwaiter
+control_in (Device const& device, ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms = 0)
+{
+	return TransferAwaiter (device, ct, Direction::In, buffer, timeout_ms);
+}
+
+
+/**
+ * Return awaitable control transfer to the device (Out direction,
+ * regardless of ct.direction). Data is copied when the awaiter is created.
+ */
+inline TransferAwaiter
+control_out (Device const& device, ControlTransfer const& ct, Span<uint8_t const> data, int timeout_ms = 0)
+{
+	return TransferAwaiter (device, ct, Direction::Out, { const_cast<uint8_t*> (data.data()), data.size() }, timeout_ms);
+}
+
+} // namespace coro
+} // namespace libusb
+
+#endif
@@ -0,0 +1,217 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "device_index.h"
+
+
+namespace libusb {
+
+DeviceIndex::Entry::Entry (Snapshot::Node const& node):
+	_descriptor (node.descriptor()),
+	_port_path (node.port_path())
+{ }
+
+
+DeviceIndex::DeviceIndex (bool read_serial_numbers):
+	_read_serial_numbers (read_serial_numbers)
+{ }
+
+
+bool
+DeviceIndex::update (Shared<Snapshot const> const& snapshot)
+{
+	if (!snapshot)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	if (snapshot == _snapshot)
+		return false;
+
+	bool changed = false;
+	++_updates;
+
+	for (auto const& node: *snapshot)
+	{
+		auto found = _entries.find (node.descriptor().get_libusb_device());
+
+		if (found != _entries.end())
+			found->second._seen_in_update = _updates;
+		else
+		{
+			Entry& entry = _entries.emplace (node.descriptor().get_libusb_device(), Entry (node)).first->second;
+			entry._seen_in_update = _updates;
+
+			if (_read_serial_numbers && entry._descriptor.serial_number_string_id() > 0)
+			{
+				try {
+					entry._serial_number = entry._descriptor.open().serial_number();
+				}
+				catch (Exception const&)
+				{
+					// Device is busy or we lack permissions. Not indexed by serial then.
+				}
+			}
+
+			add (entry);
+			changed = true;
+		}
+	}
+
+	for (auto e = _entries.begin(); e != _entries.end(); )
+	{
+		if (e->second._seen_in_update != _updates)
+		{
+			remove (e->second);
+			e = _entries.erase (e);
+			changed = true;
+		}
+		else
+			++e;
+	}
+
+	_snapshot = snapshot;
+	return changed;
+}
+
+
+DeviceIndex::Entry const*
+DeviceIndex::find_by_address (uint8_t bus_id, uint8_t address) const
+{
+	auto found = _by_address.find (address_key (bus_id, address));
+
+	if (found != _by_address.end())
+		return found->second;
+	else
+		return nullptr;
+}
+
+
+DeviceIndex::Entries const&
+DeviceIndex::find_by_vid_pid (VendorID vendor_id, ProductID product_id) const
+{
+	static Entries const empty;
+
+	auto found = _by_vid_pid.find (vid_pid_key (vendor_id, product_id));
+
+	if (found != _by_vid_pid.end())
+		return found->second;
+	else
+		return empty;
+}
+
+
+DeviceIndex::Entry const*
+DeviceIndex::find_by_port_path (uint8_t bus_id, PortPath const& port_path) const
+{
+	auto found = _by_port_path.find (port_path_key (bus_id, port_path));
+
+	if (found != _by_port_path.end())
+		return found->second;
+	else
+		return nullptr;
+}
+
+
+DeviceIndex::Entries const&
+DeviceIndex::find_by_serial_number (std::string const& serial_number) const
+{
+	static Entries const empty;
+
+	auto found = _by_serial_number.find (serial_number);
+
+	if (found != _by_serial_number.end())
+		return found->second;
+	else
+		return empty;
+}
+
+
+void
+DeviceIndex::add (Entry const& entry)
+{
+	auto const& d = entry._descriptor;
+
+	_by_address[address_key (d.bus_id(), d.address())] = &entry;
+	_by_vid_pid[vid_pid_key (d.vendor_id(), d.product_id())].push_back (&entry);
+	_by_port_path[port_path_key (d.bus_id(), entry._port_path)] = &entry;
+
+	if (entry._serial_number)
+		_by_serial_number[*entry._serial_number].push_back (&entry);
+}
+
+
+template<class Map, class Key>
+	void
+	DeviceIndex::remove_from (Map& map, Key const& key, Entry const* entry)
+	{
+		auto found = map.find (key);
+
+		if (found != map.end())
+		{
+			auto& entries = found->second;
+			entries.erase (std::remove (entries.begin(), entries.end(), entry), entries.end());
+
+			if (entries.empty())
+				map.erase (found);
+		}
+	}
+
+void
+DeviceIndex::remove (Entry const& entry)
+{
+	auto const& d = entry._descriptor;
+
+	auto a = _by_address.find (address_key (d.bus_id(), d.address()));
+	if (a != _by_address.end() && a->second == &entry)
+		_by_address.erase (a);
+
+	auto p = _by_port_path.find (port_path_key (d.bus_id(), entry._port_path));
+	if (p != _by_port_path.end() && p->second == &entry)
+		_by_port_path.erase (p);
+
+	remove_from (_by_vid_pid, vid_pid_key (d.vendor_id(), d.product_id()), &entry);
+
+	if (entry._serial_number)
+		remove_from (_by_serial_number, *entry._serial_number, &entry);
+}
+
+
+inline uint16_t
+DeviceIndex::address_key (uint8_t bus_id, uint8_t address) noexcept
+{
+	return (static_cast<uint16_t> (bus_id) << 8) | address;
+}
+
+
+inline uint32_t
+DeviceIndex::vid_pid_key (VendorID vendor_id, ProductID product_id) noexcept
+{
+	return (static_cast<uint32_t> (vendor_id) << 16) | product_id;
+}
+
+
+std::string
+DeviceIndex::port_path_key (uint8_t bus_id, PortPath const& port_path)
+{
+	std::string key (1, static_cast<char> (bus_id));
+	key.append (port_path.begin(), port_path.end());
+	return key;
+}
+
+} // namespace libusb
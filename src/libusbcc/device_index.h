@@ -0,0 +1,196 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__DEVICE_INDEX_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__DEVICE_INDEX_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "snapshot.h"
+
+
+namespace libusb {
+
+/**
+ * Hash-indexed lookup of devices from a Snapshot.
+ * Devices can be found by (bus, address), (vendor ID, product ID), port path
+ * and serial number in O(1).
+ *
+ * Call update() with a newer Snapshot to synchronize the index. Only devices
+ * that appeared or disappeared since the previous update are touched, so
+ * serial numbers of devices that stay connected are read only once.
+ */
+class DeviceIndex
+{
+  public:
+	class Entry
+	{
+		friend class DeviceIndex;
+
+	  public:
+		// Ctor
+		explicit Entry (Snapshot::Node const&);
+
+		/**
+		 * Return DeviceDescriptor of the device.
+		 */
+		DeviceDescriptor const&
+		descriptor() const noexcept;
+
+		/**
+		 * Return port numbers from the root hub down to the device.
+		 */
+		PortPath const&
+		port_path() const noexcept;
+
+		/**
+		 * Return cached serial number.
+		 * Empty if serial numbers are not read or the device couldn't be opened.
+		 */
+		Optional<std::string> const&
+		serial_number() const noexcept;
+
+	  private:
+		DeviceDescriptor		_descriptor;
+		PortPath				_port_path;
+		Optional<std::string>	_serial_number;
+		uint64_t				_seen_in_update	= 0;
+	};
+
+	typedef std::vector<Entry const*> Entries;
+
+  public:
+	/**
+	 * Ctor
+	 *
+	 * \param	read_serial_numbers
+	 * 			If true, newly seen devices that have iSerialNumber are opened
+	 * 			to read their serial numbers. Devices that can't be opened
+	 * 			are not indexed by serial number.
+	 */
+	explicit DeviceIndex (bool read_serial_numbers = false);
+
+	/**
+	 * Synchronize the index with given Snapshot.
+	 * Does nothing if the snapshot is the same as the one used previously.
+	 * Return true if the set of devices changed.
+	 * Throws StatusException (LIBUSB_ERROR_INVALID_PARAM) if snapshot is null.
+	 */
+	bool
+	update (Shared<Snapshot const> const&);
+
+	/**
+	 * Find device by bus number and address.
+	 * Return nullptr if not found.
+	 */
+	Entry const*
+	find_by_address (uint8_t bus_id, uint8_t address) const;
+
+	/**
+	 * Find devices with given vendor and product ID.
+	 */
+	Entries const&
+	find_by_vid_pid (VendorID, ProductID) const;
+
+	/**
+	 * Find device connected to given port.
+	 * Return nullptr if not found.
+	 */
+	Entry const*
+	find_by_port_path (uint8_t bus_id, PortPath const&) const;
+
+	/**
+	 * Find devices with given serial number.
+	 * Only works if serial numbers are read (see ctor).
+	 */
+	Entries const&
+	find_by_serial_number (std::string const&) const;
+
+	/**
+	 * Return number of indexed devices.
+	 */
+	std::size_t
+	size() const noexcept;
+
+  private:
+	void
+	add (Entry const&);
+
+	void
+	remove (Entry const&);
+
+	static uint16_t
+	address_key (uint8_t bus_id, uint8_t address) noexcept;
+
+	static uint32_t
+	vid_pid_key (VendorID, ProductID) noexcept;
+
+	static std::string
+	port_path_key (uint8_t bus_id, PortPath const&);
+
+	template<class Map, class Key>
+		static void
+		remove_from (Map&, Key const&, Entry const*);
+
+  private:
+	bool											_read_serial_numbers;
+	uint64_t										_updates		= 0;
+	Shared<Snapshot const>							_snapshot;
+	// Node-based container, so pointers to entries are stable:
+	std::unordered_map<libusb_device*, Entry>		_entries;
+	std::unordered_map<uint16_t, Entry const*>		_by_address;
+	std::unordered_map<uint32_t, Entries>			_by_vid_pid;
+	std::unordered_map<std::string, Entry const*>	_by_port_path;
+	std::unordered_map<std::string, Entries>		_by_serial_number;
+};
+
+
+inline DeviceDescriptor const&
+DeviceIndex::Entry::descriptor() const noexcept
+{
+	return _descriptor;
+}
+
+
+inline PortPath const&
+DeviceIndex::Entry::port_path() const noexcept
+{
+	return _port_path;
+}
+
+
+inline Optional<std::string> const&
+DeviceIndex::Entry::serial_number() const noexcept
+{
+	return _serial_number;
+}
+
+
+inline std::size_t
+DeviceIndex::size() const noexcept
+{
+	return _entries.size();
+}
+
+} // namespace libusb
+
+#endif
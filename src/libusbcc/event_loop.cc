@@ -0,0 +1,86 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "event_loop.h"
+
+
+namespace libusb {
+
+PollFDNotifier::PollFDNotifier (Bus& bus, AddedCallback added, RemovedCallback removed, bool enumerate):
+	_bus (bus),
+	_added (added),
+	_removed (removed)
+{
+	libusb_set_pollfd_notifiers (_bus.get_libusb_context(), &PollFDNotifier::handle_added, &PollFDNotifier::handle_removed, this);
+
+	if (enumerate && _added)
+	{
+		try {
+			for (auto const& pollfd: _bus.pollfds())
+				handle_added (pollfd.fd, pollfd.events, this);
+		}
+		catch (...)
+		{
+			libusb_set_pollfd_notifiers (_bus.get_libusb_context(), nullptr, nullptr, nullptr);
+			throw;
+		}
+	}
+}
+
+
+PollFDNotifier::~PollFDNotifier()
+{
+	libusb_set_pollfd_notifiers (_bus.get_libusb_context(), nullptr, nullptr, nullptr);
+}
+
+
+void LIBUSB_CALL
+PollFDNotifier::handle_added (int fd, short events, void* user_data)
+{
+	auto self = static_cast<PollFDNotifier*> (user_data);
+
+	if (self->_added)
+	{
+		try {
+			self->_added (PollFD { fd, events });
+		}
+		catch (...)
+		{
+			// Exceptions can't be propagated through libusb.
+		}
+	}
+}
+
+
+void LIBUSB_CALL
+PollFDNotifier::handle_removed (int fd, void* user_data)
+{
+	auto self = static_cast<PollFDNotifier*> (user_data);
+
+	if (self->_removed)
+	{
+		try {
+			self->_removed (fd);
+		}
+		catch (...)
+		{
+			// Exceptions can't be propagated through libusb.
+		}
+	}
+}
+
+} // namespace libusb
@@ -0,0 +1,84 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__EVENT_LOOP_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__EVENT_LOOP_H__INCLUDED
+
+// Standard:
+#include <functional>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * RAII-style wrapper for libusb_set_pollfd_notifiers(). Reports file
+ * descriptors libusb starts or stops using, so that they can be added to
+ * or removed from an external event loop (epoll, select, …).
+ *
+ * Together with Bus::pollfds(), Bus::next_timeout() and Bus::process_ready()
+ * it allows handling libusb events without the Bus's event thread.
+ *
+ * libusb supports only one set of notifiers per context, so there should be
+ * at most one PollFDNotifier per Bus. Callbacks may be called from any thread
+ * that calls libusb functions and must not throw (exceptions are swallowed).
+ */
+class PollFDNotifier
+{
+  public:
+	typedef std::function<void (PollFD const&)>	AddedCallback;
+	typedef std::function<void (int fd)>		RemovedCallback;
+
+  public:
+	/**
+	 * Ctor
+	 *
+	 * \param	enumerate
+	 * 			If true, added callback is also called for file descriptors
+	 * 			already in use. These calls are made from within the ctor.
+	 * 			May throw StatusException then.
+	 */
+	explicit PollFDNotifier (Bus&, AddedCallback added, RemovedCallback removed, bool enumerate = false);
+
+	PollFDNotifier (PollFDNotifier const&) = delete;
+
+	// Dtor
+	~PollFDNotifier();
+
+	PollFDNotifier&
+	operator= (PollFDNotifier const&) = delete;
+
+  private:
+	/**
+	 * Callbacks passed to libusb.
+	 */
+	static void LIBUSB_CALL
+	handle_added (int fd, short events, void* user_data);
+
+	static void LIBUSB_CALL
+	handle_removed (int fd, void* user_data);
+
+  private:
+	Bus&			_bus;
+	AddedCallback	_added;
+	RemovedCallback	_removed;
+};
+
+} // namespace libusb
+
+#endif
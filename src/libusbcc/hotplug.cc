@@ -0,0 +1,367 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "hotplug.h"
+
+
+namespace libusb {
+
+bool
+HotplugFilter::matches (DeviceDescriptor const& device) const
+{
+	return (!vendor_id || *vendor_id == device.vendor_id())
+		&& (!product_id || *product_id == device.product_id())
+		&& (!device_class || *device_class == device.usb_class());
+}
+
+
+HotplugPoller::HotplugPoller (Bus& bus, std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval):
+	_bus (bus),
+	_min_interval (min_interval),
+	_max_interval (std::max (min_interval, max_interval)),
+	_interval (min_interval)
+{ }
+
+
+HotplugPoller::~HotplugPoller()
+{
+	// Not locking _call_mutex, since the thread may be waiting for it to call listeners.
+	// With listeners cleared it will not call anything:
+	std::unique_lock<std::mutex> lock (_mutex);
+	_listeners.clear();
+	_stop = true;
+	lock.unlock();
+	_wake_up.notify_all();
+
+	if (_thread.joinable())
+		_thread.join();
+}
+
+
+HotplugPoller::ListenerID
+HotplugPoller::add_listener (Listener listener, bool enumerate)
+{
+	// Held until the initial enumeration is delivered, so that the polling thread
+	// can't report later changes to the new listener before it:
+	std::lock_guard<std::recursive_mutex> call_lock (_call_mutex);
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	// The thread may still be finishing after the last listener was removed.
+	// If it's still in its loop (eg. this is called from a listener), just keep it:
+	if (!_running && _thread.joinable())
+	{
+		lock.unlock();
+		_thread.join();
+		lock.lock();
+	}
+
+	auto id = _next_listener++;
+	_listeners[id] = listener;
+	_stop = false;
+
+	if (!_running)
+	{
+		try {
+			_previous_snapshot = std::make_shared<Snapshot> (_bus.get_libusb_context(), _bus.generation());
+			_previous_keys = sorted_keys (*_previous_snapshot);
+			_interval = _min_interval;
+			_thread = std::thread (&HotplugPoller::poll, this);
+		}
+		catch (...)
+		{
+			_listeners.erase (id);
+			std::throw_with_nested (Exception ("failed to start hotplug poller"));
+		}
+
+		_running = true;
+	}
+
+	auto baseline = _previous_snapshot;
+	lock.unlock();
+
+	if (enumerate)
+	{
+		DeviceChanges changes;
+		changes.arrived = baseline->descriptors();
+		listener (changes);
+	}
+
+	return id;
+}
+
+
+void
+HotplugPoller::remove_listener (ListenerID id)
+{
+	// Listeners are called with _call_mutex locked and each one is looked up
+	// just before it's called, so after erasing the listener is guaranteed not
+	// to be called anymore (or only from the current thread, if it's the polling thread):
+	std::lock_guard<std::recursive_mutex> call_lock (_call_mutex);
+	std::lock_guard<std::mutex> lock (_mutex);
+	_listeners.erase (id);
+
+	if (_listeners.empty())
+	{
+		_stop = true;
+		_wake_up.notify_all();
+	}
+}
+
+
+std::chrono::milliseconds
+HotplugPoller::interval() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _interval;
+}
+
+
+DeviceChanges
+HotplugPoller::diff (Snapshot const& previous, Snapshot const& current)
+{
+	return diff (sorted_keys (previous), sorted_keys (current));
+}
+
+
+HotplugPoller::Keys
+HotplugPoller::sorted_keys (Snapshot const& snapshot)
+{
+	Keys keys;
+	keys.reserve (snapshot.size());
+
+	for (auto const& d: snapshot.descriptors())
+		keys.emplace_back ((static_cast<uint16_t> (d.bus_id()) << 8) | d.address(), &d);
+
+	std::sort (keys.begin(), keys.end());
+	return keys;
+}
+
+
+DeviceChanges
+HotplugPoller::diff (Keys const& previous, Keys const& current)
+{
+	DeviceChanges changes;
+	auto p = previous.begin();
+	auto c = current.begin();
+
+	while (p != previous.end() || c != current.end())
+	{
+		if (c == current.end() || (p != previous.end() && p->first < c->first))
+			changes.left.push_back (*(p++)->second);
+		else if (p == previous.end() || c->first < p->first)
+			changes.arrived.push_back (*(c++)->second);
+		else
+		{
+			// Same bus and address, but the address might have been reused:
+			if (p->second->get_libusb_device() != c->second->get_libusb_device())
+			{
+				changes.left.push_back (*p->second);
+				changes.arrived.push_back (*c->second);
+			}
+
+			++p;
+			++c;
+		}
+	}
+
+	return changes;
+}
+
+
+void
+HotplugPoller::poll()
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	while (!_stop)
+	{
+		_wake_up.wait_for (lock, _interval, [this] { return _stop; });
+
+		if (_stop)
+			break;
+
+		lock.unlock();
+
+		Shared<Snapshot const> snapshot;
+		Keys keys;
+		DeviceChanges changes;
+
+		try {
+			snapshot = std::make_shared<Snapshot> (_bus.get_libusb_context(), _bus.generation());
+			keys = sorted_keys (*snapshot);
+			changes = diff (_previous_keys, keys);
+		}
+		catch (Exception const&)
+		{
+			// Enumeration failed, try again later.
+		}
+
+		lock.lock();
+
+		if (snapshot)
+		{
+			_previous_snapshot = snapshot;
+			_previous_keys.swap (keys);
+		}
+
+		if (changes.empty())
+			_interval = std::min (2 * _interval, _max_interval);
+		else
+		{
+			_interval = _min_interval;
+
+			// Listeners registered from now on get the new snapshot as their baseline,
+			// so only the current ones get these changes:
+			std::vector<ListenerID> ids;
+			ids.reserve (_listeners.size());
+
+			for (auto const& listener: _listeners)
+				ids.push_back (listener.first);
+
+			lock.unlock();
+			_bus.refresh();
+			call_listeners (ids, changes);
+			lock.lock();
+		}
+	}
+
+	_running = false;
+}
+
+
+void
+HotplugPoller::call_listeners (std::vector<ListenerID> const& ids, DeviceChanges const& changes)
+{
+	std::lock_guard<std::recursive_mutex> call_lock (_call_mutex);
+
+	for (auto id: ids)
+	{
+		Listener listener;
+
+		{
+			// Skip listeners removed in the meantime, possibly by previous listeners:
+			std::lock_guard<std::mutex> lock (_mutex);
+			auto found = _listeners.find (id);
+
+			if (found == _listeners.end())
+				continue;
+
+			listener = found->second;
+		}
+
+		listener (changes);
+	}
+}
+
+
+HotplugSubscription::HotplugSubscription (Bus& bus, HotplugFilter const& filter, Callback arrived, Callback left, bool enumerate):
+	_bus (bus),
+	_filter (filter),
+	_arrived (arrived),
+	_left (left)
+{
+	if (Bus::has_hotplug())
+	{
+		auto match = [](auto const& optional) -> int {
+			return optional ? static_cast<int> (*optional) : LIBUSB_HOTPLUG_MATCH_ANY;
+		};
+
+		_bus.acquire_event_thread();
+
+		libusb_hotplug_callback_handle handle;
+		int err = libusb_hotplug_register_callback (_bus.get_libusb_context(),
+													static_cast<libusb_hotplug_event> (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+													static_cast<libusb_hotplug_flag> (enumerate ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS),
+													match (filter.vendor_id), match (filter.product_id), match (filter.device_class),
+													&HotplugSubscription::handle_event, this, &handle);
+		if (is_error (err))
+		{
+			_bus.release_event_thread();
+			throw StatusException (static_cast<libusb_error> (err));
+		}
+
+		_handle = handle;
+	}
+	else
+	{
+		// Initial arrivals come from the poller's own device list,
+		// so that they're consistent with later changes:
+		_listener_id = _bus.hotplug_poller().add_listener ([this](DeviceChanges const& changes) {
+			handle_changes (changes);
+		}, enumerate);
+	}
+}
+
+
+HotplugSubscription::~HotplugSubscription()
+{
+	if (_handle)
+	{
+		libusb_hotplug_deregister_callback (_bus.get_libusb_context(), *_handle);
+		_bus.release_event_thread();
+	}
+
+	if (_listener_id)
+		_bus.hotplug_poller().remove_listener (*_listener_id);
+}
+
+
+int LIBUSB_CALL
+HotplugSubscription::handle_event (libusb_context*, libusb_device* device, libusb_hotplug_event event, void* user_data)
+{
+	auto self = static_cast<HotplugSubscription*> (user_data);
+	auto& callback = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? self->_arrived : self->_left;
+
+	if (callback)
+		call (callback, DeviceDescriptor (device));
+
+	// Keep the callback registered:
+	return 0;
+}
+
+
+void
+HotplugSubscription::handle_changes (DeviceChanges const& changes)
+{
+	if (_left)
+		for (auto const& d: changes.left)
+			if (_filter.matches (d))
+				call (_left, d);
+
+	if (_arrived)
+		for (auto const& d: changes.arrived)
+			if (_filter.matches (d))
+				call (_arrived, d);
+}
+
+
+void
+HotplugSubscription::call (Callback const& callback, DeviceDescriptor const& device) noexcept
+{
+	try {
+		callback (device);
+	}
+	catch (...)
+	{
+		// Exceptions can't be propagated to the event thread.
+	}
+}
+
+} // namespace libusb
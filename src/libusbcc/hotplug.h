@@ -0,0 +1,274 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__HOTPLUG_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__HOTPLUG_H__INCLUDED
+
+// Standard:
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "snapshot.h"
+
+
+namespace libusb {
+
+/**
+ * Selects devices a HotplugSubscription is interested in.
+ * Unset fields match any device.
+ */
+class HotplugFilter
+{
+  public:
+	/**
+	 * Return true if device matches the filter.
+	 */
+	bool
+	matches (DeviceDescriptor const&) const;
+
+  public:
+	Optional<VendorID>		vendor_id;
+	Optional<ProductID>		product_id;
+	Optional<DeviceClass>	device_class;
+};
+
+
+/**
+ * Devices that appeared or disappeared between two enumerations.
+ */
+class DeviceChanges
+{
+  public:
+	/**
+	 * Return true if there are no changes.
+	 */
+	bool
+	empty() const noexcept;
+
+  public:
+	DeviceDescriptors	arrived;
+	DeviceDescriptors	left;
+};
+
+
+/**
+ * Periodically enumerates devices and reports differences to listeners.
+ * Used as a fallback on platforms (or contexts) without hotplug support.
+ *
+ * Polling interval adapts: it's reset to the minimum whenever changes are
+ * detected and doubles with each poll that detects nothing, up to the maximum.
+ *
+ * Listeners are called from the polling thread, one at a time and without
+ * internal locks held, so they may add or remove listeners (including
+ * themselves) and create or destroy HotplugSubscriptions.
+ */
+class HotplugPoller
+{
+  public:
+	typedef std::function<void (DeviceChanges const&)>	Listener;
+	typedef uint64_t									ListenerID;
+
+  public:
+	// Ctor
+	explicit HotplugPoller (Bus&,
+							std::chrono::milliseconds min_interval = std::chrono::milliseconds (100),
+							std::chrono::milliseconds max_interval = std::chrono::milliseconds (2000));
+
+	HotplugPoller (HotplugPoller const&) = delete;
+
+	// Dtor
+	~HotplugPoller();
+
+	HotplugPoller&
+	operator= (HotplugPoller const&) = delete;
+
+	/**
+	 * Register listener. Starts the polling thread if it's the first one.
+	 * Changes are reported relative to the poller's current device list.
+	 *
+	 * \param	enumerate
+	 * 			If true, the listener is first called with all devices from
+	 * 			that list as arrived, before this function returns. Later
+	 * 			changes are reported relative to the same list, so no device
+	 * 			is missed or reported twice.
+	 */
+	ListenerID
+	add_listener (Listener, bool enumerate = false);
+
+	/**
+	 * Unregister listener. Stops the polling thread if it was the last one.
+	 * When it returns, the listener is guaranteed not to be called anymore.
+	 */
+	void
+	remove_listener (ListenerID);
+
+	/**
+	 * Return the current polling interval.
+	 */
+	std::chrono::milliseconds
+	interval() const;
+
+	/**
+	 * Compute differences between two snapshots.
+	 * Runs in O(n log n) for sorting and O(n) for comparison.
+	 */
+	static DeviceChanges
+	diff (Snapshot const& previous, Snapshot const& current);
+
+  private:
+	/**
+	 * Bus number and address of a device. Unique among connected devices,
+	 * and the address changes on reconnection.
+	 */
+	typedef std::pair<uint16_t, DeviceDescriptor const*> Key;
+
+	typedef std::vector<Key> Keys;
+
+	/**
+	 * Return keys of all devices sorted.
+	 */
+	static Keys
+	sorted_keys (Snapshot const&);
+
+	/**
+	 * Linear merge of two sorted key lists.
+	 */
+	static DeviceChanges
+	diff (Keys const& previous, Keys const& current);
+
+	/**
+	 * Polling thread body.
+	 */
+	void
+	poll();
+
+	/**
+	 * Call listeners with given IDs that are still registered.
+	 * Must be called with _mutex unlocked.
+	 */
+	void
+	call_listeners (std::vector<ListenerID> const& ids, DeviceChanges const& changes);
+
+  private:
+	Bus&							_bus;
+	std::chrono::milliseconds		_min_interval;
+	std::chrono::milliseconds		_max_interval;
+	std::chrono::milliseconds		_interval;
+	// Serializes calling listeners, and starting and joining the thread.
+	// Recursive, since listeners may add and remove listeners. Locked before _mutex:
+	std::recursive_mutex			_call_mutex;
+	std::mutex mutable				_mutex;
+	std::condition_variable			_wake_up;
+	bool							_stop			= false;
+	// Set while the polling thread runs its loop:
+	bool							_running		= false;
+	std::thread						_thread;
+	ListenerID						_next_listener	= 0;
+	std::map<ListenerID, Listener>	_listeners;
+	// Written with _mutex locked, by the polling thread while it runs:
+	Shared<Snapshot const>			_previous_snapshot;
+	Keys							_previous_keys;
+};
+
+
+/**
+ * RAII-style wrapper for libusb_hotplug_register_callback() +
+ * libusb_hotplug_deregister_callback().
+ *
+ * Callbacks are called from the Bus's event thread, which is kept running
+ * for as long as the subscription exists, or from within Bus::process_ready()
+ * while event handling is handed over to an external event loop (like
+ * asio::EventDriver). On platforms without hotplug
+ * support, Bus's HotplugPoller is used instead and callbacks are called
+ * from the polling thread.
+ *
+ * Callbacks should return quickly and must not throw. The subscription
+ * must not be deleted from within its own callbacks.
+ */
+class HotplugSubscription
+{
+  public:
+	typedef std::function<void (DeviceDescriptor const&)> Callback;
+
+  public:
+	/**
+	 * Ctor
+	 * May throw StatusException.
+	 *
+	 * \param	arrived, left
+	 * 			Callbacks called when matching device is connected or disconnected.
+	 * 			Either may be empty.
+	 * \param	enumerate
+	 * 			If true, arrived callback is also called for matching devices
+	 * 			that are already connected. These calls are made from within
+	 * 			the ctor, not from the event thread.
+	 */
+	explicit HotplugSubscription (Bus&, HotplugFilter const&, Callback arrived, Callback left, bool enumerate = false);
+
+	HotplugSubscription (HotplugSubscription const&) = delete;
+
+	// Dtor
+	~HotplugSubscription();
+
+	HotplugSubscription&
+	operator= (HotplugSubscription const&) = delete;
+
+  private:
+	/**
+	 * Callback passed to libusb.
+	 */
+	static int LIBUSB_CALL
+	handle_event (libusb_context*, libusb_device*, libusb_hotplug_event, void* user_data);
+
+	/**
+	 * Listener passed to HotplugPoller.
+	 */
+	void
+	handle_changes (DeviceChanges const&);
+
+	/**
+	 * Call the callback, swallow exceptions.
+	 */
+	static void
+	call (Callback const&, DeviceDescriptor const&) noexcept;
+
+  private:
+	Bus&										_bus;
+	HotplugFilter								_filter;
+	Callback									_arrived;
+	Callback									_left;
+	Optional<libusb_hotplug_callback_handle>	_handle;
+	Optional<HotplugPoller::ListenerID>			_listener_id;
+};
+
+
+inline bool
+DeviceChanges::empty() const noexcept
+{
+	return arrived.empty() && left.empty();
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,241 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <bitset>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "inventory.h"
+
+
+namespace libusb {
+
+Inventory::Mask::Mask (std::size_t size):
+	_size (size),
+	_words ((size + 63) / 64, 0)
+{ }
+
+
+std::size_t
+Inventory::Mask::count() const noexcept
+{
+	std::size_t result = 0;
+
+	for (auto w: _words)
+		result += std::bitset<64> (w).count();
+
+	return result;
+}
+
+
+std::vector<std::size_t>
+Inventory::Mask::indexes() const
+{
+	std::vector<std::size_t> result;
+
+	for (std::size_t w = 0; w < _words.size(); ++w)
+		if (_words[w])
+			for (std::size_t b = 0; b < 64; ++b)
+				if ((_words[w] >> b) & 1)
+					result.push_back (64 * w + b);
+
+	return result;
+}
+
+
+Inventory::Mask
+Inventory::Mask::operator& (Mask const& other) const
+{
+	Mask result (*this);
+	return result &= other;
+}
+
+
+Inventory::Mask
+Inventory::Mask::operator| (Mask const& other) const
+{
+	Mask result (*this);
+	return result |= other;
+}
+
+
+Inventory::Mask
+Inventory::Mask::operator~() const
+{
+	Mask result (*this);
+
+	for (auto& w: result._words)
+		w = ~w;
+
+	result.clear_tail();
+	return result;
+}
+
+
+Inventory::Mask&
+Inventory::Mask::operator&= (Mask const& other)
+{
+	check_same_size (other);
+
+	for (std::size_t i = 0; i < _words.size(); ++i)
+		_words[i] &= other._words[i];
+
+	return *this;
+}
+
+
+Inventory::Mask&
+Inventory::Mask::operator|= (Mask const& other)
+{
+	check_same_size (other);
+
+	for (std::size_t i = 0; i < _words.size(); ++i)
+		_words[i] |= other._words[i];
+
+	return *this;
+}
+
+
+void
+Inventory::Mask::clear_tail() noexcept
+{
+	if (_size % 64)
+		_words.back() &= (uint64_t (1) << (_size % 64)) - 1;
+}
+
+
+void
+Inventory::Mask::check_same_size (Mask const& other) const
+{
+	if (_size != other._size)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+}
+
+
+Inventory::Inventory (Shared<Snapshot const> snapshot):
+	_snapshot (snapshot)
+{
+	if (!_snapshot)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	auto const& descriptors = _snapshot->descriptors();
+	std::size_t padded_size = (descriptors.size() + 63) / 64 * 64;
+
+	_vendor_ids.reserve (padded_size);
+	_product_ids.reserve (padded_size);
+	_classes.reserve (padded_size);
+	_bus_ids.reserve (padded_size);
+
+	for (auto const& d: descriptors)
+	{
+		_vendor_ids.push_back (d.vendor_id());
+		_product_ids.push_back (d.product_id());
+		_classes.push_back (static_cast<uint8_t> (d.usb_class()));
+		_bus_ids.push_back (d.bus_id());
+	}
+
+	// Padding bits are cleared in results, so padding values don't matter:
+	_vendor_ids.resize (padded_size);
+	_product_ids.resize (padded_size);
+	_classes.resize (padded_size);
+	_bus_ids.resize (padded_size);
+}
+
+
+template<class T>
+	Inventory::Mask
+	Inventory::equal (std::vector<T> const& array, T value) const
+	{
+		Mask result (size());
+		T const* data = array.data();
+
+		for (std::size_t w = 0; w < result._words.size(); ++w, data += 64)
+		{
+			// Fixed-size branchless loop, so that it can be vectorized:
+			uint64_t word = 0;
+
+			for (std::size_t b = 0; b < 64; ++b)
+				word |= uint64_t (data[b] == value) << b;
+
+			result._words[w] = word;
+		}
+
+		result.clear_tail();
+		return result;
+	}
+
+
+Inventory::Mask
+Inventory::all() const
+{
+	Mask result (size());
+
+	for (auto& w: result._words)
+		w = ~uint64_t (0);
+
+	result.clear_tail();
+	return result;
+}
+
+
+Inventory::Mask
+Inventory::vendor_is (VendorID vendor_id) const
+{
+	return equal (_vendor_ids, vendor_id);
+}
+
+
+Inventory::Mask
+Inventory::product_is (ProductID product_id) const
+{
+	return equal (_product_ids, product_id);
+}
+
+
+Inventory::Mask
+Inventory::vid_pid_is (VendorID vendor_id, ProductID product_id) const
+{
+	return vendor_is (vendor_id) &= product_is (product_id);
+}
+
+
+Inventory::Mask
+Inventory::class_is (DeviceClass device_class) const
+{
+	return equal (_classes, static_cast<uint8_t> (device_class));
+}
+
+
+Inventory::Mask
+Inventory::bus_is (uint8_t bus_id) const
+{
+	return equal (_bus_ids, bus_id);
+}
+
+
+DeviceDescriptors
+Inventory::descriptors (Mask const& mask) const
+{
+	DeviceDescriptors result;
+	result.reserve (mask.count());
+
+	for (auto i: mask.indexes())
+		result.push_back (descriptor (i));
+
+	return result;
+}
+
+} // namespace libusb
@@ -0,0 +1,240 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__INVENTORY_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__INVENTORY_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "snapshot.h"
+
+
+namespace libusb {
+
+/**
+ * Devices from a Snapshot stored as parallel arrays of vendor IDs, product IDs,
+ * classes and bus numbers, for fast repeated filtering of large inventories.
+ *
+ * Queries return bitmasks with one bit per device. They're evaluated in blocks
+ * of 64 devices over contiguous arrays, which compilers can vectorize.
+ * Combine masks with &, | and ~, then materialise matches with descriptors().
+ */
+class Inventory
+{
+  public:
+	/**
+	 * Set of devices in the inventory, one bit per device.
+	 */
+	class Mask
+	{
+		friend class Inventory;
+
+	  public:
+		/**
+		 * Return true if device with given index is in the set.
+		 */
+		bool
+		test (std::size_t index) const noexcept;
+
+		/**
+		 * Return number of devices in the set.
+		 */
+		std::size_t
+		count() const noexcept;
+
+		/**
+		 * Return true if the set is empty.
+		 */
+		bool
+		none() const noexcept;
+
+		/**
+		 * Return indexes of devices in the set.
+		 */
+		std::vector<std::size_t>
+		indexes() const;
+
+		/**
+		 * Set operations. Both masks must come from the same Inventory,
+		 * otherwise StatusException (LIBUSB_ERROR_INVALID_PARAM) is thrown.
+		 */
+		Mask
+		operator& (Mask const&) const;
+
+		Mask
+		operator| (Mask const&) const;
+
+		Mask
+		operator~() const;
+
+		Mask&
+		operator&= (Mask const&);
+
+		Mask&
+		operator|= (Mask const&);
+
+	  private:
+		// Ctor
+		explicit Mask (std::size_t size);
+
+		/**
+		 * Clear bits past the last device.
+		 */
+		void
+		clear_tail() noexcept;
+
+		/**
+		 * Throw if the other mask has different size.
+		 */
+		void
+		check_same_size (Mask const&) const;
+
+	  private:
+		std::size_t				_size;
+		std::vector<uint64_t>	_words;
+	};
+
+  public:
+	/**
+	 * Ctor
+	 * Throws StatusException (LIBUSB_ERROR_INVALID_PARAM) if snapshot is null.
+	 */
+	explicit Inventory (Shared<Snapshot const>);
+
+	/**
+	 * Return number of devices.
+	 */
+	std::size_t
+	size() const noexcept;
+
+	/**
+	 * Return mask with all devices set.
+	 */
+	Mask
+	all() const;
+
+	/**
+	 * Return devices with given vendor ID.
+	 */
+	Mask
+	vendor_is (VendorID) const;
+
+	/**
+	 * Return devices with given product ID.
+	 */
+	Mask
+	product_is (ProductID) const;
+
+	/**
+	 * Return devices with given vendor and product ID.
+	 */
+	Mask
+	vid_pid_is (VendorID, ProductID) const;
+
+	/**
+	 * Return devices of given class (bDeviceClass).
+	 */
+	Mask
+	class_is (DeviceClass) const;
+
+	/**
+	 * Return devices connected to given bus.
+	 */
+	Mask
+	bus_is (uint8_t bus_id) const;
+
+	/**
+	 * Return descriptor of device with given index.
+	 */
+	DeviceDescriptor const&
+	descriptor (std::size_t index) const;
+
+	/**
+	 * Return descriptors of devices in the mask.
+	 */
+	DeviceDescriptors
+	descriptors (Mask const&) const;
+
+	/**
+	 * Return the snapshot the inventory was built from.
+	 */
+	Shared<Snapshot const> const&
+	snapshot() const noexcept;
+
+  private:
+	/**
+	 * Return mask of elements of array equal to value.
+	 */
+	template<class T>
+		Mask
+		equal (std::vector<T> const& array, T value) const;
+
+  private:
+	Shared<Snapshot const>	_snapshot;
+	// Arrays are padded to a multiple of 64 elements:
+	std::vector<uint16_t>	_vendor_ids;
+	std::vector<uint16_t>	_product_ids;
+	std::vector<uint8_t>	_classes;
+	std::vector<uint8_t>	_bus_ids;
+};
+
+
+inline bool
+Inventory::Mask::test (std::size_t index) const noexcept
+{
+	return (_words[index / 64] >> (index % 64)) & 1;
+}
+
+
+inline bool
+Inventory::Mask::none() const noexcept
+{
+	for (auto w: _words)
+		if (w)
+			return false;
+
+	return true;
+}
+
+
+inline std::size_t
+Inventory::size() const noexcept
+{
+	return _snapshot->size();
+}
+
+
+inline DeviceDescriptor const&
+Inventory::descriptor (std::size_t index) const
+{
+	return _snapshot->descriptors()[index];
+}
+
+
+inline Shared<Snapshot const> const&
+Inventory::snapshot() const noexcept
+{
+	return _snapshot;
+}
+
+} // namespace libusb
+
+#endif
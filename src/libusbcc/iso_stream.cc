@@ -0,0 +1,258 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+
+// Standard:
+#include <chrono>
+#include <limits>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "iso_stream.h"
+
+
+namespace libusb {
+
+IsoStream::IsoStream (Device const& device, uint8_t endpoint, std::size_t packet_length, Callback callback,
+					  std::size_t packets_per_transfer, std::size_t queue_depth, Shared<BufferPool> pool):
+	_direction (static_cast<Direction> (endpoint & LIBUSB_ENDPOINT_DIR_MASK)),
+	_packet_length (packet_length),
+	_callback (callback),
+	_completion_callback ([this](Transfer& transfer) { handle_completion (transfer); })
+{
+	if (packets_per_transfer == 0 || packets_per_transfer > static_cast<std::size_t> (std::numeric_limits<int>::max()))
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	auto const transfer_size = packets_per_transfer * packet_length;
+
+	if (!pool)
+		pool = BufferPool::create (device, transfer_size, BufferPool::Memory::Heap);
+	else if (pool->buffer_size() < transfer_size)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_buffers.reserve (queue_depth);
+	_transfers.reserve (queue_depth);
+
+	for (std::size_t i = 0; i < queue_depth; ++i)
+	{
+		_buffers.push_back (pool->acquire());
+		Span<uint8_t> buffer (_buffers.back().data(), transfer_size);
+
+		_transfers.push_back (Transfer::create (device, static_cast<int> (packets_per_transfer)));
+
+		if (_direction == Direction::In)
+			_transfers.back()->fill_iso_read (endpoint, buffer, packet_length);
+		else
+			_transfers.back()->fill_iso_write (endpoint, buffer, packet_length);
+	}
+}
+
+
+IsoStream::IsoStream (Device const& device, ConfigDescriptor const& config, Endpoint const& endpoint, Callback callback,
+					  std::size_t packets_per_transfer, std::size_t queue_depth, Shared<BufferPool> pool):
+	IsoStream (device, endpoint.address(), packet_length (config, endpoint), callback, packets_per_transfer, queue_depth, pool)
+{ }
+
+
+IsoStream::~IsoStream()
+{
+	stop();
+}
+
+
+void
+IsoStream::start()
+{
+	_stopping = false;
+	_error = LIBUSB_SUCCESS;
+
+	for (auto& transfer: _transfers)
+	{
+		if (transfer->in_flight())
+			continue;
+
+		if (_direction == Direction::Out)
+			call (*transfer);
+
+		++_in_flight;
+
+		try {
+			transfer->submit (_completion_callback);
+		}
+		catch (...)
+		{
+			--_in_flight;
+			stop();
+			throw;
+		}
+	}
+}
+
+
+void
+IsoStream::stop()
+{
+	_stopping = true;
+
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	// A callback that checked _stopping just before it was set may still resubmit
+	// its transfer, so keep cancelling until all are done:
+	do {
+		for (auto& transfer: _transfers)
+			transfer->cancel();
+	}
+	while (!_state_changed.wait_for (lock, std::chrono::milliseconds (10), [this] { return _in_flight.load() == 0; }));
+}
+
+
+Optional<libusb_error>
+IsoStream::error() const noexcept
+{
+	auto error = static_cast<libusb_error> (_error.load());
+
+	if (error == LIBUSB_SUCCESS)
+		return { };
+	else
+		return error;
+}
+
+
+IsoStream::Statistics
+IsoStream::statistics() const noexcept
+{
+	Statistics result;
+	result.transfers = _transfers_count.load (std::memory_order_relaxed);
+	result.packets = _packets.load (std::memory_order_relaxed);
+	result.packet_errors = _packet_errors.load (std::memory_order_relaxed);
+	result.bytes = _bytes.load (std::memory_order_relaxed);
+	return result;
+}
+
+
+std::size_t
+IsoStream::packet_length (ConfigDescriptor const& config, Endpoint const& endpoint) noexcept
+{
+	if (auto companion = config.ss_endpoint_companion (endpoint))
+		if (companion->bytes_per_interval() > 0)
+			return companion->bytes_per_interval();
+
+	return config.burst_size (endpoint);
+}
+
+
+void
+IsoStream::call (Transfer& transfer) noexcept
+{
+	if (!_callback)
+		return;
+
+	try {
+		_callback (transfer);
+	}
+	catch (...)
+	{
+		// Exceptions can't be propagated to the event thread.
+	}
+}
+
+
+void
+IsoStream::handle_completion (Transfer& transfer)
+{
+	switch (transfer.status())
+	{
+		case TransferStatus::Completed:
+		{
+			// Individual packets may fail without failing the whole transfer;
+			// a missed packet is not a reason to stop streaming:
+			uint64_t errors = 0;
+			uint64_t bytes = 0;
+
+			for (std::size_t i = 0; i < transfer.iso_packets(); ++i)
+			{
+				auto const packet = transfer.iso_packet (i);
+
+				if (packet.status == TransferStatus::Completed)
+					bytes += packet.data.size();
+				else
+					++errors;
+			}
+
+			_transfers_count.fetch_add (1, std::memory_order_relaxed);
+			_packets.fetch_add (transfer.iso_packets(), std::memory_order_relaxed);
+			_packet_errors.fetch_add (errors, std::memory_order_relaxed);
+			_bytes.fetch_add (bytes, std::memory_order_relaxed);
+
+			// For Out endpoints this also fills the transfer for resubmission:
+			if (!_stopping.load() || _direction == Direction::In)
+				call (transfer);
+
+			break;
+		}
+
+		case TransferStatus::Cancelled:
+			break;
+
+		default:
+			// Disconnection or host controller error: stop the stream and report the error:
+			fail (to_error (transfer.status()));
+			break;
+	}
+
+	if (!_stopping.load())
+	{
+		try {
+			transfer.resubmit();
+
+			// The stream may have failed in another callback after _stopping was checked:
+			if (_stopping.load())
+				transfer.cancel();
+
+			return;
+		}
+		catch (StatusException const& e)
+		{
+			fail (e.status());
+		}
+	}
+
+	transfer_finished();
+}
+
+
+void
+IsoStream::fail (libusb_error error)
+{
+	_error = error;
+	_stopping = true;
+
+	// Stop the other transfers too:
+	for (auto& transfer: _transfers)
+		transfer->cancel();
+}
+
+
+void
+IsoStream::transfer_finished()
+{
+	// Notify under the mutex, so that a waiter can't miss it between
+	// checking the predicate and going to sleep:
+	std::lock_guard<std::mutex> lock (_mutex);
+	--_in_flight;
+	_state_changed.notify_all();
+}
+
+} // namespace libusb
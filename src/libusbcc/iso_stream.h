@@ -0,0 +1,222 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+
+#ifndef MULABS_ORG__LIBUSBCC__ISO_STREAM_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__ISO_STREAM_H__INCLUDED
+
+// Standard:
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "buffer_pool.h"
+#include "config_descriptor.h"
+#include "transfer.h"
+
+
+namespace libusb {
+
+/**
+ * Continuous streaming to or from an isochronous endpoint.
+ *
+ * A fixed set of transfers, each with packets_per_transfer packet descriptors,
+ * is allocated up front, together with their buffers. Every
+ * transfer is resubmitted from its completion callback, so the transfers are
+ * reused round-robin and nothing is allocated while streaming. Isochronous
+ * endpoints get one packet per (micro)frame or service interval, so eg. with
+ * 64 packets per transfer and 4 transfers a high-speed endpoint serviced every
+ * microframe (8 kHz) completes a transfer every 8 ms and has 32 ms of requests
+ * queued in the host controller.
+ *
+ * The callback is called from the thread handling libusb events, which must
+ * be running (see Bus::acquire_event_thread()):
+ *  • for In endpoints, with each completed transfer; iterate its packets with
+ *    Transfer::iso_packet() to get the data and per-packet status,
+ *  • for Out endpoints, before each submission of a transfer, including the
+ *    first one; fill Transfer::buffer() with the data to send, packet after
+ *    packet. Results of the previous submission are available via
+ *    Transfer::iso_packet().
+ * The callback must return quickly and must not resubmit the transfer.
+ */
+class IsoStream
+{
+  public:
+	typedef std::function<void (Transfer&)> Callback;
+
+	class Statistics
+	{
+	  public:
+		// Completed transfers:
+		uint64_t	transfers		= 0;
+		// Packets in completed transfers:
+		uint64_t	packets			= 0;
+		// Packets with status other than TransferStatus::Completed:
+		uint64_t	packet_errors	= 0;
+		// Bytes transferred in successful packets:
+		uint64_t	bytes			= 0;
+	};
+
+  public:
+	/**
+	 * Ctor
+	 *
+	 * \param	endpoint
+	 * 			Endpoint address, including the direction bit.
+	 * \param	packet_length
+	 * 			Size of each packet, see packet_length().
+	 * \param	packets_per_transfer
+	 * 			Number of packets in a single transfer.
+	 * \param	queue_depth
+	 * 			Number of transfers kept in flight.
+	 * \param	pool
+	 * 			Pool to take transfer buffers from, eg. to use device memory.
+	 * 			Its buffer_size() must be at least packets_per_transfer *
+	 * 			packet_length. If null, buffers are allocated on the heap.
+	 */
+	explicit IsoStream (Device const&, uint8_t endpoint, std::size_t packet_length, Callback,
+						std::size_t packets_per_transfer = 64, std::size_t queue_depth = 4, Shared<BufferPool> pool = nullptr);
+
+	/**
+	 * Ctor
+	 * Take endpoint address and packet length from the descriptors.
+	 */
+	explicit IsoStream (Device const&, ConfigDescriptor const&, Endpoint const&, Callback,
+						std::size_t packets_per_transfer = 64, std::size_t queue_depth = 4, Shared<BufferPool> pool = nullptr);
+
+	IsoStream (IsoStream const&) = delete;
+
+	// Dtor
+	~IsoStream();
+
+	IsoStream&
+	operator= (IsoStream const&) = delete;
+
+	/**
+	 * Submit all transfers. May throw StatusException; already submitted
+	 * transfers are cancelled then.
+	 */
+	void
+	start();
+
+	/**
+	 * Cancel all transfers and block until they have completed.
+	 * Must not be called from the thread handling libusb events.
+	 */
+	void
+	stop();
+
+	/**
+	 * Return true if any transfers are in flight.
+	 */
+	bool
+	running() const noexcept;
+
+	/**
+	 * Return error that stopped the stream (eg. LIBUSB_ERROR_NO_DEVICE
+	 * on disconnection), if any. Reset by start().
+	 */
+	Optional<libusb_error>
+	error() const noexcept;
+
+	/**
+	 * Return packet length used by the stream.
+	 */
+	std::size_t
+	packet_length() const noexcept;
+
+	/**
+	 * Return transfer and packet counters.
+	 */
+	Statistics
+	statistics() const noexcept;
+
+	/**
+	 * Return max. number of bytes the isochronous endpoint transfers in
+	 * a single (micro)frame or service interval: wBytesPerInterval for
+	 * SuperSpeed endpoints, max. packet size times transactions per
+	 * microframe for others.
+	 */
+	static std::size_t
+	packet_length (ConfigDescriptor const&, Endpoint const&) noexcept;
+
+  private:
+	/**
+	 * Call the callback, swallowing exceptions.
+	 */
+	void
+	call (Transfer&) noexcept;
+
+	/**
+	 * Transfer completion callback.
+	 */
+	void
+	handle_completion (Transfer&);
+
+	/**
+	 * Record error and cancel all transfers, so that the stream stops.
+	 */
+	void
+	fail (libusb_error);
+
+	/**
+	 * Mark transfer as finished, wake up waiters.
+	 */
+	void
+	transfer_finished();
+
+  private:
+	Direction						_direction;
+	std::size_t						_packet_length;
+	Callback						_callback;
+	std::vector<BufferPool::Buffer>	_buffers;
+	std::vector<Shared<Transfer>>	_transfers;
+	Transfer::Callback				_completion_callback;
+	std::atomic<bool>				_stopping			{ false };
+	std::atomic<std::size_t>		_in_flight			{ 0 };
+	std::atomic<int>				_error				{ LIBUSB_SUCCESS };
+	std::mutex						_mutex;
+	std::condition_variable			_state_changed;
+	// Written by the event handling thread only:
+	std::atomic<uint64_t>			_transfers_count	{ 0 };
+	std::atomic<uint64_t>			_packets			{ 0 };
+	std::atomic<uint64_t>			_packet_errors		{ 0 };
+	std::atomic<uint64_t>			_bytes				{ 0 };
+};
+
+
+inline bool
+IsoStream::running() const noexcept
+{
+	return _in_flight.load() > 0;
+}
+
+
+inline std::size_t
+IsoStream::packet_length() const noexcept
+{
+	return _packet_length;
+}
+
+} // namespace libusb
+
+#endif
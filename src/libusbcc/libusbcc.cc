@@ -11,16 +11,68 @@
  * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
  */
 
-// Lib:
+// Standard:
+#include <algorithm>
+#include <cstring>
 #include <exception>
+#include <iterator>
+#include <limits>
+#include <tuple>
+#include <utility>
+
+// System:
+#include <pthread.h>
+#include <sched.h>
+
+// Lib:
 #include <libusb.h>
 
 // Local:
 #include "libusbcc.h"
+#include "snapshot.h"
+#include "hotplug.h"
+#include "config_descriptor.h"
+#include "bos_descriptor.h"
 
 
 namespace libusb {
 
+namespace {
+
+/*
+ * Typed fields of libusb_device_descriptor, shared by DeviceDescriptor and DeviceView.
+ */
+
+inline USBVersion
+to_usb_version (libusb_device_descriptor const& descriptor) noexcept
+{
+	return static_cast<USBVersion> (descriptor.bcdUSB);
+}
+
+
+inline DeviceClass
+to_device_class (libusb_device_descriptor const& descriptor) noexcept
+{
+	return static_cast<DeviceClass> (descriptor.bDeviceClass);
+}
+
+
+inline DeviceSubClass
+to_device_sub_class (libusb_device_descriptor const& descriptor) noexcept
+{
+	return static_cast<DeviceSubClass> (descriptor.bDeviceSubClass);
+}
+
+
+inline DeviceProtocol
+to_device_protocol (libusb_device_descriptor const& descriptor) noexcept
+{
+	return static_cast<DeviceProtocol> (descriptor.bDeviceProtocol);
+}
+
+} // namespace
+
+
 namespace low_level {
 
 DeviceList::DeviceList (libusb_context* context)
@@ -37,6 +89,49 @@ DeviceList::~DeviceList()
 	libusb_free_device_list (_list, 1);
 }
 
+
+DeviceHandle::DeviceHandle (libusb_device_handle* handle) noexcept:
+	_handle (handle)
+{ }
+
+
+DeviceHandle::~DeviceHandle()
+{
+	libusb_close (_handle);
+}
+
+
+void
+DeviceHandle::add_in_flight (libusb_transfer* transfer)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	_in_flight.push_back (transfer);
+}
+
+
+void
+DeviceHandle::remove_in_flight (libusb_transfer* transfer) noexcept
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	auto found = std::find (_in_flight.begin(), _in_flight.end(), transfer);
+
+	if (found != _in_flight.end())
+	{
+		*found = _in_flight.back();
+		_in_flight.pop_back();
+	}
+}
+
+
+void
+DeviceHandle::cancel_all() noexcept
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	for (auto transfer: _in_flight)
+		libusb_cancel_transfer (transfer);
+}
+
 } // namespace low_level
 
 
@@ -51,16 +146,9 @@ UnavailableException::UnavailableException():
 { }
 
 
-ControlTransfer::ControlTransfer (uint8_t request, uint16_t value, uint16_t index):
-	request (request),
-	value (value),
-	index (index)
-{ }
-
-
 Device::Device (DeviceDescriptor const& descriptor, libusb_device_handle* handle):
 	_descriptor (std::make_shared<DeviceDescriptor> (descriptor)),
-	_handle (handle)
+	_handle (std::make_shared<low_level::DeviceHandle> (handle))
 { }
 
 
@@ -72,7 +160,8 @@ Device::~Device()
 
 Device::Device (Device&& other):
 	_descriptor (other._descriptor),
-	_handle (other._handle)
+	_handle (std::move (other._handle)),
+	_bos_descriptor (other._bos_descriptor)
 {
 	other.reset_object();
 }
@@ -83,7 +172,8 @@ Device::operator= (Device&& other)
 {
 	cleanup_object();
 	_descriptor = other._descriptor;
-	_handle = other._handle;
+	_handle = std::move (other._handle);
+	_bos_descriptor = other._bos_descriptor;
 	other.reset_object();
 	return *this;
 }
@@ -117,55 +207,134 @@ Device::serial_number() const
 }
 
 
+BOSDescriptor const&
+Device::bos_descriptor() const
+{
+	std::lock_guard<std::mutex> lock (_bos_descriptor_mutex);
+
+	if (!_bos_descriptor)
+		_bos_descriptor = std::make_shared<BOSDescriptor> (_handle->get());
+
+	return *_bos_descriptor;
+}
+
+
 void
-Device::send (ControlTransfer const& ct, int timeout_ms, std::vector<uint8_t> const& buffer)
+Device::send (ControlTransfer const& ct, int timeout_ms, Span<uint8_t const> buffer)
 {
 	// For to-device transfers we can assume that buffer will not change.
 	// Therefore allow const_cast to make C function happy.
-	auto ll_buffer = const_cast<uint8_t*> (buffer.data());
-	int bytes_transferred = libusb_control_transfer (_handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-													 ct.request, ct.value, ct.index, ll_buffer, buffer.size(), timeout_ms);
-	if (is_error (bytes_transferred))
-		throw StatusException (static_cast<libusb_error> (bytes_transferred));
+	control_transfer (ct.request_type (Direction::Out), ct.request, ct.value, ct.index,
+					  const_cast<uint8_t*> (buffer.data()), buffer.size(), timeout_ms);
+}
+
+
+void
+Device::send (ControlTransfer const& ct, int timeout_ms, std::initializer_list<uint8_t> data)
+{
+	send (ct, timeout_ms, Span<uint8_t const> (data.begin(), data.size()));
 }
 
 
 std::vector<uint8_t>
-Device::receive (ControlTransfer const& ct, int timeout_ms)
+Device::receive (ControlTransfer const& ct, int timeout_ms, std::size_t max_length)
 {
-	// Control transfers may carry up to 64 bytes of data, so allocate a vector of 64 bytes:
-	std::vector<uint8_t> buffer (64, 0);
-	int bytes_transferred = libusb_control_transfer (_handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
-													 ct.request, ct.value, ct.index, buffer.data(), buffer.size(), timeout_ms);
-	if (is_error (bytes_transferred))
-		throw StatusException (static_cast<libusb_error> (bytes_transferred));
-	buffer.resize (bytes_transferred);
+	std::vector<uint8_t> buffer (max_length, 0);
+	buffer.resize (receive (ct, buffer, timeout_ms));
 	return buffer;
 }
 
 
+std::size_t
+Device::receive (ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms)
+{
+	return control_transfer (ct.request_type (Direction::In), ct.request, ct.value, ct.index,
+							 buffer.data(), buffer.size(), timeout_ms);
+}
+
+
+std::size_t
+Device::control (ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms)
+{
+	return control_transfer (ct.request_type(), ct.request, ct.value, ct.index,
+							 buffer.data(), buffer.size(), timeout_ms);
+}
+
+
+std::size_t
+Device::bulk_write (uint8_t endpoint, Span<uint8_t const> buffer, int timeout_ms)
+{
+	// For to-device transfers the buffer is not modified:
+	return bulk_transfer (endpoint & ~LIBUSB_ENDPOINT_IN, const_cast<uint8_t*> (buffer.data()), buffer.size(), timeout_ms);
+}
+
+
+std::size_t
+Device::bulk_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms)
+{
+	return bulk_transfer (endpoint | LIBUSB_ENDPOINT_IN, buffer.data(), buffer.size(), timeout_ms);
+}
+
+
 void
 Device::reset()
 {
-	auto status = libusb_reset_device (_handle);
+	auto status = libusb_reset_device (_handle->get());
 
 	if (is_error (status))
 		throw StatusException (static_cast<libusb_error> (status));
 }
 
 
+std::size_t
+Device::control_transfer (uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+						  uint8_t* buffer, std::size_t size, int timeout_ms)
+{
+	// wLength is 16-bit:
+	if (size > std::numeric_limits<uint16_t>::max())
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	int bytes_transferred = libusb_control_transfer (_handle->get(), request_type, request, value, index,
+													 buffer, static_cast<uint16_t> (size), timeout_ms);
+	if (is_error (bytes_transferred))
+		throw StatusException (static_cast<libusb_error> (bytes_transferred));
+
+	return static_cast<std::size_t> (bytes_transferred);
+}
+
+
+std::size_t
+Device::bulk_transfer (uint8_t endpoint, uint8_t* buffer, std::size_t size, int timeout_ms)
+{
+	if (size > static_cast<std::size_t> (std::numeric_limits<int>::max()))
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	int transferred = 0;
+	int status = libusb_bulk_transfer (_handle->get(), endpoint, buffer, static_cast<int> (size), &transferred, timeout_ms);
+
+	// Timed out transfers may still have transferred some data, which would be lost otherwise:
+	if (is_error (status) && !(status == LIBUSB_ERROR_TIMEOUT && transferred > 0))
+		throw StatusException (static_cast<libusb_error> (status));
+
+	return static_cast<std::size_t> (transferred);
+}
+
+
 inline void
 Device::reset_object()
 {
-	_handle = nullptr;
+	_handle.reset();
 }
 
 
 inline void
 Device::cleanup_object()
 {
+	// The handle is closed when the last in-flight transfer releases it:
 	if (_handle)
-		libusb_close (_handle);
+		_handle->cancel_all();
+
+	_handle.reset();
 }
 
 
@@ -176,7 +345,7 @@ Device::get_usb_string (int string_id) const
 	if (string_id > 0)
 	{
 		char buffer[256];
-		int chars = libusb_get_string_descriptor_ascii (_handle, string_id, reinterpret_cast<unsigned char*> (buffer), sizeof (buffer));
+		int chars = libusb_get_string_descriptor_ascii (_handle->get(), string_id, reinterpret_cast<unsigned char*> (buffer), sizeof (buffer));
 		if (chars < 0)
 			throw StatusException (static_cast<libusb_error> (chars));
 		buffer[chars] = 0;
@@ -190,19 +359,27 @@ Device::get_usb_string (int string_id) const
 DeviceDescriptor::DeviceDescriptor (libusb_device* device):
 	_device (device)
 {
+	int err = libusb_get_device_descriptor (_device, &_descriptor);
+	if (is_error (err))
+		throw StatusException (static_cast<libusb_error> (err));
+
 	libusb_ref_device (_device);
 }
 
 
 DeviceDescriptor::DeviceDescriptor (DeviceDescriptor const& other):
-	_device (other._device)
+	_device (other._device),
+	_descriptor (other._descriptor),
+	_config_descriptors (other.cached_config_descriptors())
 {
 	libusb_ref_device (_device);
 }
 
 
 DeviceDescriptor::DeviceDescriptor (DeviceDescriptor&& other):
-	_device (other._device)
+	_device (other._device),
+	_descriptor (other._descriptor),
+	_config_descriptors (std::move (other._config_descriptors))
 {
 	other.reset_object();
 }
@@ -217,9 +394,15 @@ DeviceDescriptor::~DeviceDescriptor()
 DeviceDescriptor&
 DeviceDescriptor::operator= (DeviceDescriptor const& other)
 {
+	// Reference first, in case of self-assignment:
+	libusb_ref_device (other._device);
 	cleanup_object();
 	_device = other._device;
-	libusb_ref_device (_device);
+	_descriptor = other._descriptor;
+
+	auto config_descriptors = other.cached_config_descriptors();
+	std::lock_guard<std::mutex> lock (_config_descriptors_mutex);
+	_config_descriptors.swap (config_descriptors);
 	return *this;
 }
 
@@ -229,6 +412,10 @@ DeviceDescriptor::operator= (DeviceDescriptor&& other)
 {
 	cleanup_object();
 	_device = other._device;
+	_descriptor = other._descriptor;
+
+	std::lock_guard<std::mutex> lock (_config_descriptors_mutex);
+	_config_descriptors = std::move (other._config_descriptors);
 	other.reset_object();
 	return *this;
 }
@@ -248,14 +435,21 @@ DeviceDescriptor::open() const
 uint8_t
 DeviceDescriptor::bus_id() const noexcept
 {
-	return libusb_get_bus_number (_device);
+	return view().bus_id();
 }
 
 
 uint8_t
 DeviceDescriptor::port_id() const noexcept
 {
-	return libusb_get_port_number (_device);
+	return view().port_id();
+}
+
+
+PortPath
+DeviceDescriptor::port_path() const
+{
+	return view().port_path();
 }
 
 
@@ -278,14 +472,42 @@ DeviceDescriptor::parent (Bus const& bus) const
 uint8_t
 DeviceDescriptor::address() const noexcept
 {
-	return libusb_get_device_address (_device);
+	return view().address();
+}
+
+
+Speed
+DeviceDescriptor::speed() const noexcept
+{
+	return view().speed();
+}
+
+
+const char*
+DeviceDescriptor::speed_str() const noexcept
+{
+	switch (speed())
+	{
+		case Speed::Low:
+			return "1.5 Mbit/s";
+		case Speed::Full:
+			return "12 Mbit/s";
+		case Speed::High:
+			return "480 Mbit/s";
+		case Speed::Super:
+			return "5 Gbit/s";
+		case Speed::SuperPlus:
+			return "10 Gbit/s";
+		default:
+			return "unknown";
+	}
 }
 
 
 USBVersion
 DeviceDescriptor::usb_version() const
 {
-	return static_cast<USBVersion> (descriptor().bcdUSB);
+	return to_usb_version (descriptor());
 }
 
 
@@ -298,8 +520,14 @@ DeviceDescriptor::usb_version_str() const
 			return "1.1";
 		case USBVersion::V_2_0:
 			return "2.0";
+		case USBVersion::V_2_1:
+			return "2.1";
 		case USBVersion::V_3_0:
 			return "3.0";
+		case USBVersion::V_3_1:
+			return "3.1";
+		case USBVersion::V_3_2:
+			return "3.2";
 		default:
 			return "unknown";
 	}
@@ -338,21 +566,21 @@ DeviceDescriptor::product_id() const
 DeviceClass
 DeviceDescriptor::usb_class() const
 {
-	return static_cast<DeviceClass> (descriptor().bDeviceClass);
+	return to_device_class (descriptor());
 }
 
 
 DeviceSubClass
 DeviceDescriptor::usb_sub_class() const
 {
-	return static_cast<DeviceSubClass> (descriptor().bDeviceSubClass);
+	return to_device_sub_class (descriptor());
 }
 
 
 DeviceProtocol
 DeviceDescriptor::usb_protocol() const
 {
-	return static_cast<DeviceProtocol> (descriptor().bDeviceProtocol);
+	return to_device_protocol (descriptor());
 }
 
 
@@ -370,19 +598,67 @@ DeviceDescriptor::max_packet_size_0() const
 }
 
 
-inline libusb_device_descriptor&
-DeviceDescriptor::descriptor() const
+ConfigDescriptor const&
+DeviceDescriptor::config_descriptor (uint8_t index) const
 {
-	if (_descriptor)
-		return *_descriptor;
-	else
+	// Resizing the vector doesn't move ConfigDescriptors, so returned references stay valid:
+	std::lock_guard<std::mutex> lock (_config_descriptors_mutex);
+
+	if (index >= _config_descriptors.size())
+		_config_descriptors.resize (index + 1);
+
+	auto& cached = _config_descriptors[index];
+
+	if (!cached)
 	{
-		_descriptor.emplace (libusb_device_descriptor());
-		int err = libusb_get_device_descriptor (_device, _descriptor.get_ptr());
+		libusb_config_descriptor* descriptor;
+		int err = libusb_get_config_descriptor (_device, index, &descriptor);
 		if (is_error (err))
 			throw StatusException (static_cast<libusb_error> (err));
-		return *_descriptor;
+		cached = std::make_shared<ConfigDescriptor> (descriptor);
 	}
+
+	return *cached;
+}
+
+
+Shared<ConfigDescriptor const>
+DeviceDescriptor::active_config_descriptor() const
+{
+	libusb_config_descriptor* descriptor;
+	int err = libusb_get_active_config_descriptor (_device, &descriptor);
+	if (is_error (err))
+		throw StatusException (static_cast<libusb_error> (err));
+	return std::make_shared<ConfigDescriptor> (descriptor);
+}
+
+
+DeviceKey
+DeviceDescriptor::key() const
+{
+	return DeviceKey (*this);
+}
+
+
+uint8_t
+DeviceDescriptor::serial_number_string_id() const
+{
+	return descriptor().iSerialNumber;
+}
+
+
+inline libusb_device_descriptor const&
+DeviceDescriptor::descriptor() const noexcept
+{
+	return _descriptor;
+}
+
+
+std::vector<Shared<ConfigDescriptor const>>
+DeviceDescriptor::cached_config_descriptors() const
+{
+	std::lock_guard<std::mutex> lock (_config_descriptors_mutex);
+	return _config_descriptors;
 }
 
 
@@ -401,63 +677,779 @@ DeviceDescriptor::cleanup_object()
 }
 
 
-Bus::Bus()
+DeviceKey::DeviceKey (uint8_t bus_id, PortPath port_path, VendorID vendor_id, ProductID product_id, Optional<std::string> serial_number):
+	_bus_id (bus_id),
+	_port_path (std::move (port_path)),
+	_vendor_id (vendor_id),
+	_product_id (product_id),
+	_serial_number (std::move (serial_number)),
+	_hash (0)
 {
-	try {
-		int err = libusb_init (&_context);
-		if (is_error (err))
-			throw StatusException (static_cast<libusb_error> (err));
-	}
-	catch (...)
-	{
-		std::throw_with_nested (Exception ("failed to create libusb session"));
-	}
+	boost::hash_combine (_hash, _bus_id);
+	boost::hash_range (_hash, _port_path.begin(), _port_path.end());
+	boost::hash_combine (_hash, _vendor_id);
+	boost::hash_combine (_hash, _product_id);
+
+	if (_serial_number)
+		boost::hash_combine (_hash, *_serial_number);
 }
 
 
-Bus::~Bus()
+DeviceKey::DeviceKey (DeviceDescriptor const& descriptor):
+	DeviceKey (descriptor.bus_id(), descriptor.port_path(), descriptor.vendor_id(), descriptor.product_id())
+{ }
+
+
+DeviceKey::DeviceKey (DeviceDescriptor const& descriptor, std::string const& serial_number):
+	DeviceKey (descriptor.bus_id(), descriptor.port_path(), descriptor.vendor_id(), descriptor.product_id(), serial_number)
+{ }
+
+
+bool
+DeviceKey::operator== (DeviceKey const& other) const
 {
-	libusb_exit (_context);
+	return _hash == other._hash
+		&& _bus_id == other._bus_id
+		&& _vendor_id == other._vendor_id
+		&& _product_id == other._product_id
+		&& _port_path == other._port_path
+		&& _serial_number == other._serial_number;
 }
 
 
-DeviceDescriptors
-Bus::device_descriptors() const
+bool
+DeviceKey::operator< (DeviceKey const& other) const
 {
-	DeviceDescriptors result;
+	return std::tie (_bus_id, _port_path, _vendor_id, _product_id, _serial_number)
+		 < std::tie (other._bus_id, other._port_path, other._vendor_id, other._product_id, other._serial_number);
+}
 
-	try {
-		low_level::DeviceList devices (_context);
 
-		// Build list of Devices:
-		for (auto const& d: devices)
-			result.emplace_back (d);
-	}
-	catch (...)
-	{
-		std::throw_with_nested (Exception ("failed to get device list"));
-	}
+DeviceDescriptor
+DeviceView::promote() const
+{
+	return DeviceDescriptor (_device);
+}
 
-	return result;
+
+uint8_t
+DeviceView::bus_id() const noexcept
+{
+	return libusb_get_bus_number (_device);
 }
 
 
-Optional<DeviceDescriptor>
-Bus::find_by_address (uint8_t address) const
+uint8_t
+DeviceView::port_id() const noexcept
 {
-	try {
-		low_level::DeviceList devices (_context);
+	return libusb_get_port_number (_device);
+}
 
-		for (auto const& lld: devices)
-			if (libusb_get_device_address (lld) == address)
-				return { DeviceDescriptor (lld) };
-	}
-	catch (...)
-	{
-		std::throw_with_nested (Exception ("failed to get device by address"));
-	}
 
-	return { };
+PortPath
+DeviceView::port_path() const
+{
+	// USB 3.0 specs say that 7 is the maximum depth:
+	uint8_t ports[7];
+	int count = libusb_get_port_numbers (_device, ports, sizeof (ports));
+
+	if (is_error (count))
+		throw StatusException (static_cast<libusb_error> (count));
+
+	return PortPath (ports, ports + count);
+}
+
+
+uint8_t
+DeviceView::address() const noexcept
+{
+	return libusb_get_device_address (_device);
+}
+
+
+Speed
+DeviceView::speed() const noexcept
+{
+	return static_cast<Speed> (libusb_get_device_speed (_device));
+}
+
+
+USBVersion
+DeviceView::usb_version() const
+{
+	return to_usb_version (descriptor());
+}
+
+
+uint16_t
+DeviceView::release_version() const
+{
+	return descriptor().bcdDevice;
+}
+
+
+VendorID
+DeviceView::vendor_id() const
+{
+	return descriptor().idVendor;
+}
+
+
+ProductID
+DeviceView::product_id() const
+{
+	return descriptor().idProduct;
+}
+
+
+DeviceClass
+DeviceView::usb_class() const
+{
+	return to_device_class (descriptor());
+}
+
+
+DeviceSubClass
+DeviceView::usb_sub_class() const
+{
+	return to_device_sub_class (descriptor());
+}
+
+
+DeviceProtocol
+DeviceView::usb_protocol() const
+{
+	return to_device_protocol (descriptor());
+}
+
+
+uint8_t
+DeviceView::num_configurations() const
+{
+	return descriptor().bNumConfigurations;
+}
+
+
+uint8_t
+DeviceView::serial_number_string_id() const
+{
+	return descriptor().iSerialNumber;
+}
+
+
+uint8_t
+DeviceView::max_packet_size_0() const
+{
+	return descriptor().bMaxPacketSize0;
+}
+
+
+libusb_device_descriptor const&
+DeviceView::descriptor() const
+{
+	if (!_descriptor)
+	{
+		libusb_device_descriptor descriptor;
+		int err = libusb_get_device_descriptor (_device, &descriptor);
+		if (is_error (err))
+			throw StatusException (static_cast<libusb_error> (err));
+		_descriptor = descriptor;
+	}
+
+	return *_descriptor;
+}
+
+
+DeviceRange::Iterator::Iterator (Shared<low_level::DeviceList const> list, libusb_device** position, Shared<Predicates const> predicates):
+	_list (list),
+	_position (position),
+	_predicates (predicates),
+	_view (nullptr)
+{
+	skip_unmatched();
+}
+
+
+DeviceRange::Iterator&
+DeviceRange::Iterator::operator++()
+{
+	++_position;
+	skip_unmatched();
+	return *this;
+}
+
+
+DeviceRange::Iterator
+DeviceRange::Iterator::operator++ (int)
+{
+	Iterator copy = *this;
+	++*this;
+	return copy;
+}
+
+
+void
+DeviceRange::Iterator::skip_unmatched()
+{
+	for (; _position != _list->end(); ++_position)
+	{
+		// A fresh view for each device, so that predicates share
+		// the lazily obtained libusb_device_descriptor:
+		_view = DeviceView (*_position);
+
+		if (std::all_of (_predicates->begin(), _predicates->end(), [this](Predicate const& p) { return p (_view); }))
+			break;
+	}
+}
+
+
+DeviceRange::DeviceRange (Shared<low_level::DeviceList const> list):
+	_list (list),
+	_predicates (std::make_shared<Predicates const>())
+{ }
+
+
+DeviceRange
+DeviceRange::filter (Predicate predicate) const
+{
+	auto predicates = std::make_shared<Predicates> (*_predicates);
+	predicates->push_back (predicate);
+
+	DeviceRange result (*this);
+	result._predicates = predicates;
+	return result;
+}
+
+
+DeviceRange::Iterator
+DeviceRange::begin() const
+{
+	return Iterator (_list, _list->begin(), _predicates);
+}
+
+
+DeviceRange::Iterator
+DeviceRange::end() const
+{
+	return Iterator (_list, _list->end(), _predicates);
+}
+
+
+DeviceDescriptors
+DeviceRange::descriptors() const
+{
+	DeviceDescriptors result;
+
+	for (auto const& view: *this)
+		result.push_back (view.promote());
+
+	return result;
+}
+
+
+Optional<DeviceDescriptor>
+DeviceRange::first() const
+{
+	auto b = begin();
+
+	if (b != end())
+		return b->promote();
+	else
+		return { };
+}
+
+
+std::size_t
+DeviceRange::count() const
+{
+	return std::distance (begin(), end());
+}
+
+
+namespace filters {
+
+DeviceRange::Predicate
+vid_pid (VendorID vendor_id, ProductID product_id)
+{
+	return [=](DeviceView const& view) {
+		return view.vendor_id() == vendor_id && view.product_id() == product_id;
+	};
+}
+
+
+DeviceRange::Predicate
+vendor (VendorID vendor_id)
+{
+	return [=](DeviceView const& view) {
+		return view.vendor_id() == vendor_id;
+	};
+}
+
+
+DeviceRange::Predicate
+device_class (DeviceClass device_class)
+{
+	return [=](DeviceView const& view) {
+		return view.usb_class() == device_class;
+	};
+}
+
+
+DeviceRange::Predicate
+on_bus (uint8_t bus_id)
+{
+	return [=](DeviceView const& view) {
+		return view.bus_id() == bus_id;
+	};
+}
+
+} // namespace filters
+
+
+Bus::Bus()
+{
+	try {
+		int err = libusb_init (&_context);
+		if (is_error (err))
+			throw StatusException (static_cast<libusb_error> (err));
+	}
+	catch (...)
+	{
+		std::throw_with_nested (Exception ("failed to create libusb session"));
+	}
+}
+
+
+Bus::~Bus()
+{
+	_hotplug_poller.reset();
+
+	{
+		std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+		if (_event_thread.joinable())
+			stop_event_thread();
+	}
+
+	{
+		// Cached descriptors unref their devices, which needs the context.
+		// Snapshots held by users at this point outlive the Bus, which is not allowed:
+		std::lock_guard<std::mutex> lock (_snapshot_mutex);
+		_snapshot.reset();
+	}
+
+	libusb_exit (_context);
+}
+
+
+Shared<DeviceDescriptors const>
+Bus::device_descriptors() const
+{
+	auto snapshot = this->snapshot();
+	// Share ownership with the snapshot, no copying:
+	return Shared<DeviceDescriptors const> (snapshot, &snapshot->descriptors());
+}
+
+
+DeviceRange
+Bus::devices() const
+{
+	try {
+		return DeviceRange (std::make_shared<low_level::DeviceList> (_context));
+	}
+	catch (...)
+	{
+		std::throw_with_nested (Exception ("failed to get device list"));
+	}
+}
+
+
+Shared<Snapshot const>
+Bus::snapshot() const
+{
+	std::lock_guard<std::mutex> lock (_snapshot_mutex);
+
+	// Read generation before enumerating, so that a refresh() that happens
+	// during enumeration causes another enumeration next time:
+	uint64_t generation = _generation.load();
+
+	if (!_snapshot || _snapshot->generation() != generation)
+	{
+		try {
+			_snapshot = std::make_shared<Snapshot> (_context, generation);
+		}
+		catch (...)
+		{
+			std::throw_with_nested (Exception ("failed to get device list"));
+		}
+	}
+
+	return _snapshot;
+}
+
+
+Optional<DeviceDescriptor>
+Bus::find_by_address (uint8_t address) const
+{
+	try {
+		low_level::DeviceList devices (_context);
+
+		for (auto const& lld: devices)
+			if (libusb_get_device_address (lld) == address)
+				return { DeviceDescriptor (lld) };
+	}
+	catch (...)
+	{
+		std::throw_with_nested (Exception ("failed to get device by address"));
+	}
+
+	return { };
+}
+
+
+Optional<DeviceDescriptor>
+Bus::find_by_address (uint8_t bus_id, uint8_t address) const
+{
+	try {
+		low_level::DeviceList devices (_context);
+
+		for (auto const& lld: devices)
+			if (libusb_get_bus_number (lld) == bus_id && libusb_get_device_address (lld) == address)
+				return { DeviceDescriptor (lld) };
+	}
+	catch (...)
+	{
+		std::throw_with_nested (Exception ("failed to get device by address"));
+	}
+
+	return { };
+}
+
+
+void
+Bus::acquire_event_thread()
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+	if (_event_thread_users++ == 0 && _external_event_handlers == 0)
+	{
+		try {
+			start_event_thread();
+		}
+		catch (...)
+		{
+			--_event_thread_users;
+			std::throw_with_nested (Exception ("failed to start event thread"));
+		}
+	}
+}
+
+
+void
+Bus::release_event_thread()
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+	if (_event_thread_users > 0 && --_event_thread_users == 0 && _event_thread.joinable())
+		stop_event_thread();
+}
+
+
+void
+Bus::acquire_external_event_handling()
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+	if (_external_event_handlers == 0)
+	{
+		if (in_event_thread())
+			throw Exception ("can't hand over event handling from within the event thread");
+
+		// Hotplug events will be handled by the external loop from now on:
+		register_hotplug_refresh();
+
+		if (_event_thread.joinable())
+			join_event_thread();
+	}
+
+	++_external_event_handlers;
+}
+
+
+void
+Bus::release_external_event_handling()
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+	if (_external_event_handlers > 0 && --_external_event_handlers == 0)
+	{
+		deregister_hotplug_refresh();
+
+		if (_event_thread_users > 0)
+		{
+			try {
+				start_event_thread();
+			}
+			catch (...)
+			{
+				std::throw_with_nested (Exception ("failed to start event thread"));
+			}
+		}
+	}
+}
+
+
+EventThreadConfig
+Bus::event_thread_config() const
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+	return _event_thread_config;
+}
+
+
+void
+Bus::set_event_thread_config (EventThreadConfig const& config)
+{
+	std::lock_guard<std::mutex> lock (_event_thread_mutex);
+
+	if (_event_thread.joinable())
+		apply_event_thread_config (config);
+
+	_event_thread_config = config;
+}
+
+
+PollFDs
+Bus::pollfds() const
+{
+	std::unique_ptr<libusb_pollfd const*[], void (*)(libusb_pollfd const**)> list (libusb_get_pollfds (_context), &libusb_free_pollfds);
+
+	if (!list)
+		throw StatusException (LIBUSB_ERROR_NOT_SUPPORTED);
+
+	PollFDs result;
+
+	for (auto p = list.get(); *p; ++p)
+		result.push_back ({ (*p)->fd, (*p)->events });
+
+	return result;
+}
+
+
+Optional<std::chrono::microseconds>
+Bus::next_timeout() const
+{
+	timeval tv;
+	int status = libusb_get_next_timeout (_context, &tv);
+
+	if (is_error (status))
+		throw StatusException (static_cast<libusb_error> (status));
+	else if (status == 0)
+		return { };
+	else
+		return std::chrono::seconds (tv.tv_sec) + std::chrono::microseconds (tv.tv_usec);
+}
+
+
+void
+Bus::process_ready()
+{
+	timeval zero { 0, 0 };
+	int err = libusb_handle_events_timeout (_context, &zero);
+
+	if (is_error (err))
+		throw StatusException (static_cast<libusb_error> (err));
+}
+
+
+HotplugPoller&
+Bus::hotplug_poller()
+{
+	std::lock_guard<std::mutex> lock (_hotplug_poller_mutex);
+
+	if (!_hotplug_poller)
+		_hotplug_poller = std::make_unique<HotplugPoller> (*this);
+
+	return *_hotplug_poller;
+}
+
+
+void
+Bus::start_event_thread()
+{
+	register_hotplug_refresh();
+
+	try {
+		_event_thread_stop = false;
+		_event_thread = std::thread (&Bus::handle_events, this);
+	}
+	catch (...)
+	{
+		deregister_hotplug_refresh();
+		throw;
+	}
+
+	try {
+		apply_event_thread_config (_event_thread_config);
+	}
+	catch (...)
+	{
+		stop_event_thread();
+		throw;
+	}
+}
+
+
+void
+Bus::stop_event_thread()
+{
+	deregister_hotplug_refresh();
+	join_event_thread();
+}
+
+
+void
+Bus::join_event_thread()
+{
+	_event_thread_stop = true;
+	libusb_interrupt_event_handler (_context);
+	_event_thread.join();
+}
+
+
+void
+Bus::register_hotplug_refresh()
+{
+	if (has_hotplug() && !_hotplug_refresh_handle)
+	{
+		libusb_hotplug_callback_handle handle;
+		int err = libusb_hotplug_register_callback (_context,
+													static_cast<libusb_hotplug_event> (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+													LIBUSB_HOTPLUG_NO_FLAGS,
+													LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+													&Bus::hotplug_refresh, this, &handle);
+		if (is_error (err))
+			throw StatusException (static_cast<libusb_error> (err));
+
+		_hotplug_refresh_handle = handle;
+
+		try {
+			// Events may have been missed while nobody was listening:
+			refresh();
+		}
+		catch (...)
+		{
+			deregister_hotplug_refresh();
+			throw;
+		}
+	}
+}
+
+
+void
+Bus::deregister_hotplug_refresh() noexcept
+{
+	if (_hotplug_refresh_handle)
+	{
+		libusb_hotplug_deregister_callback (_context, *_hotplug_refresh_handle);
+		_hotplug_refresh_handle.reset();
+	}
+}
+
+
+void
+Bus::handle_events()
+{
+	while (!_event_thread_stop.load())
+	{
+		// Timeout is only a safety net, the thread is woken up
+		// with libusb_interrupt_event_handler():
+		timeval timeout { 1, 0 };
+		libusb_handle_events_timeout_completed (_context, &timeout, nullptr);
+	}
+}
+
+
+void
+Bus::apply_event_thread_config (EventThreadConfig const& config)
+{
+	auto thread = _event_thread.native_handle();
+
+	// Validate everything before changing anything:
+	if (config.fifo_priority)
+	{
+		auto const min = sched_get_priority_min (SCHED_FIFO);
+		auto const max = sched_get_priority_max (SCHED_FIFO);
+
+		if (*config.fifo_priority < min || *config.fifo_priority > max)
+			throw Exception ("event thread SCHED_FIFO priority out of range: " + std::to_string (*config.fifo_priority));
+	}
+
+#if defined(__linux__)
+	cpu_set_t cpu_set;
+	CPU_ZERO (&cpu_set);
+
+	if (config.cpu_affinity.empty())
+	{
+		// Any CPU, which also resets affinity set previously:
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET (cpu, &cpu_set);
+	}
+	else
+	{
+		for (auto cpu: config.cpu_affinity)
+		{
+			if (cpu >= static_cast<unsigned int> (CPU_SETSIZE))
+				throw Exception ("event thread CPU index out of range: " + std::to_string (cpu));
+
+			CPU_SET (cpu, &cpu_set);
+		}
+	}
+
+	// Kept for rolling back if setting the scheduling policy fails:
+	cpu_set_t previous_cpu_set;
+	int err = pthread_getaffinity_np (thread, sizeof (previous_cpu_set), &previous_cpu_set);
+	if (err != 0)
+		throw Exception (std::string ("failed to get event thread CPU affinity: ") + std::strerror (err));
+
+	err = pthread_setaffinity_np (thread, sizeof (cpu_set), &cpu_set);
+	if (err != 0)
+		throw Exception (std::string ("failed to set event thread CPU affinity: ") + std::strerror (err));
+#else
+	if (!config.cpu_affinity.empty())
+		throw Exception ("CPU affinity is not supported on this platform");
+#endif
+
+	// Leave inherited policy alone, unless SCHED_FIFO is requested or was set before:
+	if (config.fifo_priority || _event_thread_config.fifo_priority)
+	{
+		sched_param param { };
+		int policy = SCHED_OTHER;
+
+		if (config.fifo_priority)
+		{
+			policy = SCHED_FIFO;
+			param.sched_priority = *config.fifo_priority;
+		}
+
+		int err = pthread_setschedparam (thread, policy, &param);
+		if (err != 0)
+		{
+#if defined(__linux__)
+			pthread_setaffinity_np (thread, sizeof (previous_cpu_set), &previous_cpu_set);
+#endif
+			throw Exception (std::string ("failed to set event thread scheduling policy: ") + std::strerror (err));
+		}
+	}
+}
+
+
+int LIBUSB_CALL
+Bus::hotplug_refresh (libusb_context*, libusb_device*, libusb_hotplug_event, void* user_data)
+{
+	static_cast<Bus*> (user_data)->refresh();
+	// Keep the callback registered:
+	return 0;
 }
 
 
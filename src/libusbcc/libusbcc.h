@@ -19,10 +19,21 @@
 #include <stdexcept>
 #include <vector>
 #include <memory>
+#include <initializer_list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
 
 // Lib:
 #include <libusb.h>
 #include <boost/optional.hpp>
+#include <boost/functional/hash.hpp>
 
 // TinyIO:
 #include <tinyio/config/all.h>
@@ -44,9 +55,14 @@ class DeviceList
 	 */
 	explicit DeviceList (libusb_context*);
 
+	DeviceList (DeviceList const&) = delete;
+
 	// Dtor
 	~DeviceList();
 
+	DeviceList&
+	operator= (DeviceList const&) = delete;
+
 	/**
 	 * Access the list elements.
 	 */
@@ -104,12 +120,83 @@ DeviceList::end() const noexcept
 	return _list + _size;
 }
 
+
+/**
+ * Owns an open libusb_device_handle (closes it in dtor) and keeps track
+ * of asynchronous transfers submitted on it. Shared by Device and its
+ * in-flight Transfers, so that the handle is closed only after the last
+ * transfer has completed, even if the Device is destroyed earlier.
+ */
+class DeviceHandle
+{
+  public:
+	// Ctor
+	explicit DeviceHandle (libusb_device_handle*) noexcept;
+
+	DeviceHandle (DeviceHandle const&) = delete;
+
+	// Dtor
+	~DeviceHandle();
+
+	DeviceHandle&
+	operator= (DeviceHandle const&) = delete;
+
+	/**
+	 * Return the libusb handle.
+	 */
+	libusb_device_handle*
+	get() const noexcept;
+
+	/**
+	 * Register transfer as submitted.
+	 */
+	void
+	add_in_flight (libusb_transfer*);
+
+	/**
+	 * Unregister transfer after it has completed.
+	 */
+	void
+	remove_in_flight (libusb_transfer*) noexcept;
+
+	/**
+	 * Request cancellation of all in-flight transfers.
+	 * Their callbacks are still called (from the event handling thread).
+	 */
+	void
+	cancel_all() noexcept;
+
+  private:
+	libusb_device_handle*			_handle;
+	std::mutex						_mutex;
+	std::vector<libusb_transfer*>	_in_flight;
+};
+
+
+inline libusb_device_handle*
+DeviceHandle::get() const noexcept
+{
+	return _handle;
+}
+
 } // namespace low_level
 
 
 class Device;
 class DeviceDescriptor;
+class DeviceView;
+class DeviceKey;
+class ConfigDescriptor;
+class BOSDescriptor;
 class Bus;
+class Snapshot;
+class HotplugPoller;
+class BulkStreams;
+class BufferPool;
+
+namespace coro {
+class TransferAwaiter;
+} // namespace coro
 
 
 template<class T>
@@ -119,11 +206,119 @@ template<class T>
 	using Shared = std::shared_ptr<T>;
 
 
+/**
+ * Non-owning view of a contiguous sequence of elements (pointer + size),
+ * used to pass caller-owned buffers without copying or allocating.
+ * Minimal stand-in for C++20 std::span.
+ *
+ * Implicitly constructible from C arrays and from containers with data()
+ * and size() (std::vector, std::array, std::string). Spans of const
+ * elements may also refer to temporaries; the temporary must outlive the call.
+ */
+template<class T>
+	class Span
+	{
+	  public:
+		typedef T			element_type;
+		typedef T*			iterator;
+
+	  public:
+		// Ctor
+		constexpr
+		Span() noexcept = default;
+
+		// Ctor
+		// A template, so that integers (eg. brace-init { 0, 5 }) can't be taken for null pointers:
+		template<class U, class = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+			constexpr
+			Span (U* data, std::size_t size) noexcept:
+				_data (data),
+				_size (size)
+			{ }
+
+		// Ctor
+		template<std::size_t N>
+			constexpr
+			Span (T (&array)[N]) noexcept:
+				Span (array, N)
+			{ }
+
+		// Ctor
+		template<class Container,
+				 class = std::enable_if_t<std::is_convertible<std::remove_pointer_t<decltype (std::declval<Container&>().data())> (*)[], T (*)[]>::value>,
+				 class = std::enable_if_t<std::is_lvalue_reference<Container>::value || std::is_const<T>::value>>
+			constexpr
+			Span (Container&& container) noexcept:
+				Span (container.data(), container.size())
+			{ }
+
+		// Ctor
+		template<class U, class = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+			constexpr
+			Span (Span<U> const& other) noexcept:
+				Span (other.data(), other.size())
+			{ }
+
+		constexpr T*
+		data() const noexcept
+			{ return _data; }
+
+		constexpr std::size_t
+		size() const noexcept
+			{ return _size; }
+
+		constexpr bool
+		empty() const noexcept
+			{ return _size == 0; }
+
+		constexpr T*
+		begin() const noexcept
+			{ return _data; }
+
+		constexpr T*
+		end() const noexcept
+			{ return _data + _size; }
+
+		constexpr T&
+		operator[] (std::size_t index) const noexcept
+			{ return _data[index]; }
+
+		/**
+		 * Return view of count elements starting at offset.
+		 * Both must be within the span.
+		 */
+		constexpr Span
+		subspan (std::size_t offset, std::size_t count) const noexcept
+			{ return Span (_data + offset, count); }
+
+	  private:
+		T*			_data	= nullptr;
+		std::size_t	_size	= 0;
+	};
+
+
 enum class USBVersion: uint16_t
 {
 	V_1_1	= 0x0110,
 	V_2_0	= 0x0200,
+	V_2_1	= 0x0210,
 	V_3_0	= 0x0300,
+	V_3_1	= 0x0310,
+	V_3_2	= 0x0320,
+};
+
+
+/**
+ * Negotiated link speed.
+ */
+enum class Speed: uint8_t
+{
+	Unknown		= LIBUSB_SPEED_UNKNOWN,
+	Low			= LIBUSB_SPEED_LOW,
+	Full		= LIBUSB_SPEED_FULL,
+	High		= LIBUSB_SPEED_HIGH,
+	Super		= LIBUSB_SPEED_SUPER,
+	SuperPlus	= LIBUSB_SPEED_SUPER_PLUS,
 };
 
 
@@ -145,9 +340,31 @@ enum class DeviceProtocol: uint8_t
 };
 
 
+enum class Direction: uint8_t
+{
+	Out	= LIBUSB_ENDPOINT_OUT,
+	In	= LIBUSB_ENDPOINT_IN,
+};
+
+
+enum class TransferType: uint8_t
+{
+	Control		= LIBUSB_TRANSFER_TYPE_CONTROL,
+	Isochronous	= LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+	Bulk		= LIBUSB_TRANSFER_TYPE_BULK,
+	Interrupt	= LIBUSB_TRANSFER_TYPE_INTERRUPT,
+};
+
+
 typedef uint16_t VendorID;
 typedef uint16_t ProductID;
 
+/**
+ * List of port numbers from the root hub down to the device.
+ * Empty for root hubs.
+ */
+typedef std::vector<uint8_t> PortPath;
+
 
 class Exception: public std::runtime_error
 {
@@ -186,28 +403,131 @@ class UnavailableException: public Exception
 };
 
 
+/**
+ * Type of control request (bits 5…6 of bmRequestType).
+ */
+enum class RequestType: uint8_t
+{
+	Standard	= LIBUSB_REQUEST_TYPE_STANDARD,
+	Class		= LIBUSB_REQUEST_TYPE_CLASS,
+	Vendor		= LIBUSB_REQUEST_TYPE_VENDOR,
+	Reserved	= LIBUSB_REQUEST_TYPE_RESERVED,
+};
+
+
+/**
+ * Recipient of control request (bits 0…4 of bmRequestType).
+ */
+enum class Recipient: uint8_t
+{
+	Device		= LIBUSB_RECIPIENT_DEVICE,
+	Interface	= LIBUSB_RECIPIENT_INTERFACE,
+	Endpoint	= LIBUSB_RECIPIENT_ENDPOINT,
+	Other		= LIBUSB_RECIPIENT_OTHER,
+};
+
+
+/**
+ * Return bmRequestType for given request type, recipient and direction.
+ */
+constexpr uint8_t
+make_request_type (RequestType type, Recipient recipient, Direction direction) noexcept
+{
+	return static_cast<uint8_t> (type) | static_cast<uint8_t> (recipient) | static_cast<uint8_t> (direction);
+}
+
+
 /**
  * Encapsulates USB control transfers.
+ *
+ * Device::send() and Device::receive() use the Out and In direction
+ * respectively, regardless of the direction member. Device::control()
+ * uses the direction member.
  */
 class ControlTransfer
 {
   public:
 	// Ctor
-	ControlTransfer (uint8_t request, uint16_t value, uint16_t index);
+	constexpr
+	ControlTransfer (uint8_t request, uint16_t value, uint16_t index,
+					 RequestType type = RequestType::Vendor,
+					 Recipient recipient = Recipient::Device,
+					 Direction direction = Direction::Out) noexcept;
+
+	/**
+	 * Return bmRequestType.
+	 */
+	constexpr uint8_t
+	request_type() const noexcept;
+
+	/**
+	 * Return bmRequestType with direction replaced with given one.
+	 */
+	constexpr uint8_t
+	request_type (Direction) const noexcept;
 
   public:
-	uint8_t		request	= 0;
-	uint16_t	value	= 0;
-	uint16_t	index	= 0;
+	uint8_t		request		= 0;
+	uint16_t	value		= 0;
+	uint16_t	index		= 0;
+	RequestType	type		= RequestType::Vendor;
+	Recipient	recipient	= Recipient::Device;
+	Direction	direction	= Direction::Out;
 };
 
 
+/**
+ * Control request with bmRequestType and bRequest fixed at compile time,
+ * for example:
+ *
+ *   using ReadRegister = ControlRequest<RequestType::Vendor, Recipient::Interface, Direction::In, 0x42>;
+ *   device.receive (ReadRegister (address, interface_number), buffer);
+ *
+ * Device::send() accepts only Out requests and Device::receive() only In ones;
+ * mismatches are compile-time errors.
+ */
+template<RequestType pType, Recipient pRecipient, Direction pDirection, uint8_t pRequest>
+	class ControlRequest
+	{
+	  public:
+		static constexpr RequestType	type			= pType;
+		static constexpr Recipient		recipient		= pRecipient;
+		static constexpr Direction		direction		= pDirection;
+		static constexpr uint8_t		request			= pRequest;
+		static constexpr uint8_t		request_type	= make_request_type (pType, pRecipient, pDirection);
+
+	  public:
+		// Ctor
+		constexpr explicit
+		ControlRequest (uint16_t value = 0, uint16_t index = 0) noexcept:
+			value (value),
+			index (index)
+		{ }
+
+		constexpr
+		operator ControlTransfer() const noexcept
+			{ return ControlTransfer (request, value, index, type, recipient, direction); }
+
+	  public:
+		uint16_t	value;
+		uint16_t	index;
+	};
+
+
 /**
  * Represents an opened USB device.
  * All Devices must be deleted before Bus is deleted.
+ *
+ * Destroying a Device cancels its in-flight Transfers. Transfers keep
+ * the device handle open; it's closed when the last of them is destroyed.
  */
 class Device
 {
+	friend class Transfer;
+	friend class BulkStreams;
+	friend class BufferPool;
+	friend class coro::TransferAwaiter;
+
   public:
 	/**
 	 * Ctor
@@ -257,23 +577,108 @@ class Device
 	std::string
 	serial_number() const;
 
+	/**
+	 * Return Binary Object Store descriptor of the device (USB 2.1+).
+	 * Obtained on first use and cached. Throws StatusException if the device
+	 * doesn't provide one.
+	 */
+	BOSDescriptor const&
+	bos_descriptor() const;
+
+	/**
+	 * Make a synchronous bulk transfer to the device. Doesn't allocate.
+	 * May throw StatusException. If the transfer times out after some data
+	 * has been sent, the number of bytes sent so far is returned instead.
+	 *
+	 * \param	endpoint
+	 * 			Endpoint address. The direction bit is cleared.
+	 * \param	timeout_ms
+	 * 			Timeout in milliseconds. 0 means unlimited timeout.
+	 * \return	number of bytes sent.
+	 */
+	std::size_t
+	bulk_write (uint8_t endpoint, Span<uint8_t const> buffer, int timeout_ms = 0);
+
+	/**
+	 * Make a synchronous bulk transfer from the device. Doesn't allocate.
+	 * May throw StatusException. If the transfer times out after some data
+	 * has been received, the number of bytes received so far is returned instead.
+	 *
+	 * \param	endpoint
+	 * 			Endpoint address. The direction bit is set.
+	 * \param	timeout_ms
+	 * 			Timeout in milliseconds. 0 means unlimited timeout.
+	 * \return	number of bytes received.
+	 */
+	std::size_t
+	bulk_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms = 0);
+
 	/**
 	 * Make a synchronous control transfer to the device.
+	 * Accepts any contiguous buffer (vector, array, C array) of up to
+	 * 65535 bytes, without copying it.
 	 *
 	 * \param	timeout_ms
 	 * 			Timeout in milliseconds. 0 means unlimited timeout.
 	 */
 	void
-	send (ControlTransfer const&, int timeout_ms = 0, std::vector<uint8_t> const& buffer = {});
+	send (ControlTransfer const&, int timeout_ms = 0, Span<uint8_t const> buffer = {});
+
+	/**
+	 * Like send (ControlTransfer const&, int, Span<uint8_t const>), for data
+	 * given inline, eg. device.send (ct, 0, { 0x00, 0x05 }).
+	 */
+	void
+	send (ControlTransfer const&, int timeout_ms, std::initializer_list<uint8_t> data);
 
 	/**
 	 * Make a synchronous control transfer from the device.
 	 *
 	 * \param	timeout_ms
 	 * 			Timeout in milliseconds. 0 means unlimited timeout.
+	 * \param	max_length
+	 * 			Size of the data stage to request (wLength), up to 65535.
 	 */
 	std::vector<uint8_t>
-	receive (ControlTransfer const& ct, int timeout_ms = 0);
+	receive (ControlTransfer const& ct, int timeout_ms = 0, std::size_t max_length = 64);
+
+	/**
+	 * Make a synchronous control transfer from the device into a caller-owned
+	 * buffer. Doesn't allocate. wLength is the size of the buffer, up to 65535.
+	 *
+	 * \param	timeout_ms
+	 * 			Timeout in milliseconds. 0 means unlimited timeout.
+	 * \return	number of bytes received.
+	 */
+	std::size_t
+	receive (ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Make a synchronous control transfer in the direction given by the
+	 * ControlTransfer. Doesn't allocate.
+	 *
+	 * \param	timeout_ms
+	 * 			Timeout in milliseconds. 0 means unlimited timeout.
+	 * \return	number of bytes transferred.
+	 */
+	std::size_t
+	control (ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Like send (ControlTransfer const&, …), but the setup packet is built
+	 * at compile time.
+	 */
+	template<RequestType Type, Recipient Recip, Direction Dir, uint8_t Request>
+		void
+		send (ControlRequest<Type, Recip, Dir, Request> const&, int timeout_ms = 0, Span<uint8_t const> buffer = {});
+
+	/**
+	 * Like receive (ControlTransfer const&, Span<uint8_t>, …), but the setup
+	 * packet is built at compile time.
+	 */
+	template<RequestType Type, Recipient Recip, Direction Dir, uint8_t Request>
+		std::size_t
+		receive (ControlRequest<Type, Recip, Dir, Request> const&, Span<uint8_t> buffer, int timeout_ms = 0);
 
 	/**
 	 * Perform a USB port reset to reinitialize a device.
@@ -291,7 +696,27 @@ class Device
 	void
 	reset();
 
+	/**
+	 * Return the underlying libusb device handle, for use with libusb
+	 * functions not wrapped by this class. Must not be closed.
+	 */
+	libusb_device_handle*
+	get_libusb_handle() const noexcept;
+
   private:
+	/**
+	 * Control transfer, shared by send() and receive().
+	 */
+	std::size_t
+	control_transfer (uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+					  uint8_t* buffer, std::size_t size, int timeout_ms);
+
+	/**
+	 * Bulk transfer, shared by bulk_write() and bulk_read().
+	 */
+	std::size_t
+	bulk_transfer (uint8_t endpoint, uint8_t* buffer, std::size_t size, int timeout_ms);
+
 	/**
 	 * Empty the object (destructor will do nothing).
 	 */
@@ -299,7 +724,7 @@ class Device
 	reset_object();
 
 	/**
-	 * Close device if it was open, unreference the device.
+	 * Cancel in-flight transfers and release the device handle.
 	 * Use when destroying or moving-out.
 	 */
 	void
@@ -314,8 +739,11 @@ class Device
 
   private:
 	// Can be nullptr after a move-out:
-	Shared<DeviceDescriptor>		_descriptor;
-	libusb_device_handle*			_handle		= nullptr;
+	Shared<DeviceDescriptor>				_descriptor;
+	// Can be nullptr after a move-out:
+	Shared<low_level::DeviceHandle>			_handle;
+	std::mutex mutable						_bos_descriptor_mutex;
+	Shared<BOSDescriptor const> mutable		_bos_descriptor;
 };
 
 
@@ -328,7 +756,10 @@ class DeviceDescriptor
 	friend class Device;
 
   public:
-	// Ctor
+	/**
+	 * Ctor
+	 * Obtains the device descriptor. May throw StatusException.
+	 */
 	explicit DeviceDescriptor (libusb_device*);
 
 	DeviceDescriptor (DeviceDescriptor const&);
@@ -363,8 +794,15 @@ class DeviceDescriptor
 	uint8_t
 	port_id() const noexcept;
 
+	/**
+	 * Return the list of all port numbers from root for the specified device.
+	 */
+	PortPath
+	port_path() const;
+
 	/**
 	 * Get the parent from the specified device.
+	 * Enumerates all devices on each call; to walk the device tree use Bus::snapshot().
 	 */
 	DeviceDescriptor
 	parent (Bus const&) const;
@@ -375,6 +813,19 @@ class DeviceDescriptor
 	uint8_t
 	address() const noexcept;
 
+	/**
+	 * Return negotiated link speed. Unlike usb_version(), which is what
+	 * the device supports, this is the speed it's actually running at.
+	 */
+	Speed
+	speed() const noexcept;
+
+	/**
+	 * Return link speed as human-readable string.
+	 */
+	const char*
+	speed_str() const noexcept;
+
 	/**
 	 * Return USB version.
 	 */
@@ -441,6 +892,59 @@ class DeviceDescriptor
 	uint8_t
 	max_packet_size_0() const;
 
+	/**
+	 * Return index of string descriptor containing serial number (iSerialNumber).
+	 * Value of 0 means the device has no serial number.
+	 */
+	uint8_t
+	serial_number_string_id() const;
+
+	/**
+	 * Return configuration descriptor with given index (0…num_configurations() - 1).
+	 * Obtained on first use and cached. Copies of this DeviceDescriptor made
+	 * afterwards share the cache. The reference is valid for as long as this
+	 * object or any of its copies exists.
+	 */
+	ConfigDescriptor const&
+	config_descriptor (uint8_t index = 0) const;
+
+	/**
+	 * Return descriptor of the currently active configuration.
+	 * Not cached, since the active configuration may change.
+	 */
+	Shared<ConfigDescriptor const>
+	active_config_descriptor() const;
+
+	/**
+	 * Return libusb device pointer.
+	 */
+	libusb_device*
+	get_libusb_device() const noexcept;
+
+	/**
+	 * Return non-owning view of this device.
+	 * The view is valid for as long as this object exists.
+	 */
+	DeviceView
+	view() const noexcept;
+
+	/**
+	 * Return stable identity of the device, without serial number.
+	 */
+	DeviceKey
+	key() const;
+
+	/**
+	 * Compare underlying libusb devices.
+	 * Note that the same physical device gets a new libusb device when
+	 * reconnected. Use key() to compare identities.
+	 */
+	bool
+	operator== (DeviceDescriptor const& other) const noexcept;
+
+	bool
+	operator!= (DeviceDescriptor const& other) const noexcept;
+
   private:
 	/**
 	 * Empty the object (destructor will do nothing).
@@ -456,71 +960,985 @@ class DeviceDescriptor
 	cleanup_object();
 
 	/**
-	 * Return device descriptor. If not obtained, obtain it.
+	 * Return device descriptor obtained in the ctor.
 	 */
-	libusb_device_descriptor&
-	descriptor() const;
+	libusb_device_descriptor const&
+	descriptor() const noexcept;
+
+	/**
+	 * Return copy of _config_descriptors, taken with the mutex locked.
+	 */
+	std::vector<Shared<ConfigDescriptor const>>
+	cached_config_descriptors() const;
 
   private:
-	libusb_device*								_device;
-	Optional<libusb_device_descriptor> mutable	_descriptor;
+	libusb_device*										_device;
+	// Never changes after construction, so it can be read from any thread:
+	libusb_device_descriptor							_descriptor;
+	// Guards _config_descriptors, since descriptors may be shared between threads
+	// (eg. through Shared<Snapshot const>):
+	std::mutex mutable									_config_descriptors_mutex;
+	std::vector<Shared<ConfigDescriptor const>> mutable	_config_descriptors;
 };
 
 
+inline libusb_device*
+DeviceDescriptor::get_libusb_device() const noexcept
+{
+	return _device;
+}
+
+
+inline bool
+DeviceDescriptor::operator== (DeviceDescriptor const& other) const noexcept
+{
+	return _device == other._device;
+}
+
+
+inline bool
+DeviceDescriptor::operator!= (DeviceDescriptor const& other) const noexcept
+{
+	return !(*this == other);
+}
+
+
 typedef std::vector<DeviceDescriptor> DeviceDescriptors;
 
 
 /**
- * Represents libusb session.
- * http://libusb.sourceforge.net/api-1.0/contexts.html
+ * Identity of a physical USB device that survives re-enumeration
+ * and reconnection to the same port. Made of bus number, full port path,
+ * vendor/product ID and optionally the serial number.
+ *
+ * Unlike addresses or libusb device pointers, keys can be used
+ * to key caches (eg. std::unordered_map) across enumerations.
  */
-class Bus
+class DeviceKey
 {
   public:
 	// Ctor
-	Bus();
+	explicit DeviceKey (uint8_t bus_id, PortPath, VendorID, ProductID, Optional<std::string> serial_number = { });
 
-	// Dtor
-	~Bus();
+	/**
+	 * Ctor
+	 * Create key without serial number.
+	 */
+	explicit DeviceKey (DeviceDescriptor const&);
 
 	/**
-	 * Return libusb context pointer.
+	 * Ctor
+	 * Create key with given serial number (see Device::serial_number()).
 	 */
-	libusb_context*
-	get_libusb_context() const noexcept;
+	explicit DeviceKey (DeviceDescriptor const&, std::string const& serial_number);
 
 	/**
-	 * Return list of devices detected in the system.
+	 * Return the number of the bus.
 	 */
-	DeviceDescriptors
-	device_descriptors() const;
+	uint8_t
+	bus_id() const noexcept;
 
 	/**
-	 * Find and return DeviceDescriptor with specified address.
+	 * Return port numbers from the root hub down to the device.
 	 */
-	Optional<DeviceDescriptor>
-	find_by_address (uint8_t address) const;
+	PortPath const&
+	port_path() const noexcept;
+
+	/**
+	 * Return vendor ID.
+	 */
+	VendorID
+	vendor_id() const noexcept;
+
+	/**
+	 * Return product ID.
+	 */
+	ProductID
+	product_id() const noexcept;
+
+	/**
+	 * Return serial number, if it's part of the key.
+	 */
+	Optional<std::string> const&
+	serial_number() const noexcept;
+
+	/**
+	 * Return hash value. Computed once in ctor.
+	 */
+	std::size_t
+	hash() const noexcept;
+
+	bool
+	operator== (DeviceKey const&) const;
+
+	bool
+	operator!= (DeviceKey const&) const;
+
+	bool
+	operator< (DeviceKey const&) const;
 
   private:
-	libusb_context* _context;
+	uint8_t					_bus_id;
+	PortPath				_port_path;
+	VendorID				_vendor_id;
+	ProductID				_product_id;
+	Optional<std::string>	_serial_number;
+	std::size_t				_hash;
 };
 
 
-inline libusb_context*
-Bus::get_libusb_context() const noexcept
+inline uint8_t
+DeviceKey::bus_id() const noexcept
 {
-	return _context;
+	return _bus_id;
 }
 
 
-/**
- * Return true if an int returned by libusb function
- * is an error status code.
- */
-bool
-is_error (int status);
+inline PortPath const&
+DeviceKey::port_path() const noexcept
+{
+	return _port_path;
+}
+
+
+inline VendorID
+DeviceKey::vendor_id() const noexcept
+{
+	return _vendor_id;
+}
+
+
+inline ProductID
+DeviceKey::product_id() const noexcept
+{
+	return _product_id;
+}
+
+
+inline Optional<std::string> const&
+DeviceKey::serial_number() const noexcept
+{
+	return _serial_number;
+}
+
+
+inline std::size_t
+DeviceKey::hash() const noexcept
+{
+	return _hash;
+}
+
+
+inline bool
+DeviceKey::operator!= (DeviceKey const& other) const
+{
+	return !(*this == other);
+}
+
+
+/**
+ * Non-owning view of a USB device.
+ * Unlike DeviceDescriptor, it doesn't reference the libusb device, so copying
+ * it doesn't take libusb's internal lock. The view is valid only for as long
+ * as the device is kept alive by something else: a live low_level::DeviceList,
+ * a Snapshot or a DeviceDescriptor.
+ *
+ * Use promote() to obtain an owning DeviceDescriptor.
+ */
+class DeviceView
+{
+  public:
+	// Ctor
+	explicit DeviceView (libusb_device*) noexcept;
+
+	/**
+	 * Return owning DeviceDescriptor for the device.
+	 * References the device.
+	 */
+	DeviceDescriptor
+	promote() const;
+
+	/**
+	 * Return the number of the bus that a device is connected to.
+	 */
+	uint8_t
+	bus_id() const noexcept;
+
+	/**
+	 * Return the number of the port that a device is connected to.
+	 * Value of 0 means the port number is not available.
+	 */
+	uint8_t
+	port_id() const noexcept;
+
+	/**
+	 * Return the list of all port numbers from root for the specified device.
+	 */
+	PortPath
+	port_path() const;
+
+	/**
+	 * Return the address of the device on the bus it is connected to.
+	 */
+	uint8_t
+	address() const noexcept;
+
+	/**
+	 * Return negotiated link speed.
+	 */
+	Speed
+	speed() const noexcept;
+
+	/**
+	 * Return USB version.
+	 */
+	USBVersion
+	usb_version() const;
+
+	/**
+	 * Device version.
+	 */
+	uint16_t
+	release_version() const;
+
+	/**
+	 * Return device's vendor ID.
+	 */
+	VendorID
+	vendor_id() const;
+
+	/**
+	 * Return device's product ID.
+	 */
+	ProductID
+	product_id() const;
+
+	/**
+	 * Return USB class of the device (bDeviceClass).
+	 */
+	DeviceClass
+	usb_class() const;
+
+	/**
+	 * Return USB sub-class of the device (bDeviceSubClass).
+	 */
+	DeviceSubClass
+	usb_sub_class() const;
+
+	/**
+	 * Return USB protocol (bDeviceProtocol).
+	 */
+	DeviceProtocol
+	usb_protocol() const;
+
+	/**
+	 * Return number of configurations of the device.
+	 */
+	uint8_t
+	num_configurations() const;
+
+	/**
+	 * Return max. packet size for configuration 0.
+	 */
+	uint8_t
+	max_packet_size_0() const;
+
+	/**
+	 * Return index of string descriptor containing serial number (iSerialNumber).
+	 * Value of 0 means the device has no serial number.
+	 */
+	uint8_t
+	serial_number_string_id() const;
+
+	/**
+	 * Return libusb device descriptor. If not obtained, obtain it.
+	 */
+	libusb_device_descriptor const&
+	descriptor() const;
+
+	/**
+	 * Return libusb device pointer.
+	 */
+	libusb_device*
+	get_libusb_device() const noexcept;
+
+	/**
+	 * Compare underlying libusb devices.
+	 */
+	bool
+	operator== (DeviceView const& other) const noexcept;
+
+	bool
+	operator!= (DeviceView const& other) const noexcept;
+
+  private:
+	libusb_device*								_device;
+	Optional<libusb_device_descriptor> mutable	_descriptor;
+};
+
+
+inline
+DeviceView::DeviceView (libusb_device* device) noexcept:
+	_device (device)
+{ }
+
+
+inline libusb_device*
+DeviceView::get_libusb_device() const noexcept
+{
+	return _device;
+}
+
+
+inline bool
+DeviceView::operator== (DeviceView const& other) const noexcept
+{
+	return _device == other._device;
+}
+
+
+inline bool
+DeviceView::operator!= (DeviceView const& other) const noexcept
+{
+	return !(*this == other);
+}
+
+
+inline DeviceView
+DeviceDescriptor::view() const noexcept
+{
+	return DeviceView (_device);
+}
+
+
+/**
+ * Lazily filtered range of devices from a single enumeration.
+ * Iterates over low_level::DeviceList directly and yields DeviceViews
+ * that pass all predicates. Nothing is referenced or copied until matches
+ * are materialised with descriptors() or first().
+ *
+ * Yielded views are valid for as long as any copy of the range, or any
+ * iterator obtained from it, exists. Iterators share the device list and
+ * predicates with the range, so they may outlive it.
+ *
+ * Predicates for common criteria are in namespace filters.
+ */
+class DeviceRange
+{
+  public:
+	typedef std::function<bool (DeviceView const&)>	Predicate;
+	typedef std::vector<Predicate>					Predicates;
+
+	class Iterator
+	{
+	  public:
+		typedef std::forward_iterator_tag	iterator_category;
+		typedef DeviceView const			value_type;
+		typedef std::ptrdiff_t				difference_type;
+		typedef DeviceView const*			pointer;
+		typedef DeviceView const&			reference;
+
+	  public:
+		// Ctor
+		explicit Iterator (Shared<low_level::DeviceList const>, libusb_device** position, Shared<Predicates const>);
+
+		DeviceView const&
+		operator*() const noexcept;
+
+		DeviceView const*
+		operator->() const noexcept;
+
+		Iterator&
+		operator++();
+
+		Iterator
+		operator++ (int);
+
+		bool
+		operator== (Iterator const&) const noexcept;
+
+		bool
+		operator!= (Iterator const&) const noexcept;
+
+	  private:
+		/**
+		 * Advance _position to the first device that matches predicates.
+		 */
+		void
+		skip_unmatched();
+
+	  private:
+		Shared<low_level::DeviceList const>	_list;
+		libusb_device**						_position;
+		Shared<Predicates const>			_predicates;
+		DeviceView							_view;
+	};
+
+  public:
+	// Ctor
+	explicit DeviceRange (Shared<low_level::DeviceList const>);
+
+	/**
+	 * Return range with an additional predicate.
+	 */
+	DeviceRange
+	filter (Predicate) const;
+
+	/**
+	 * Return iterator to the first matching device.
+	 */
+	Iterator
+	begin() const;
+
+	/**
+	 * Return after-the-last iterator.
+	 */
+	Iterator
+	end() const;
+
+	/**
+	 * Return DeviceDescriptors of all matching devices.
+	 */
+	DeviceDescriptors
+	descriptors() const;
+
+	/**
+	 * Return DeviceDescriptor of the first matching device, if any.
+	 */
+	Optional<DeviceDescriptor>
+	first() const;
+
+	/**
+	 * Return number of matching devices.
+	 */
+	std::size_t
+	count() const;
+
+  private:
+	Shared<low_level::DeviceList const>	_list;
+	// Shared with iterators, replaced (not modified) by filter():
+	Shared<Predicates const>			_predicates;
+};
+
+
+namespace filters {
+
+/**
+ * Predicate for DeviceRange::filter() that matches devices with given vendor and product ID.
+ */
+DeviceRange::Predicate
+vid_pid (VendorID, ProductID);
+
+/**
+ * Predicate for DeviceRange::filter() that matches devices with given vendor ID.
+ */
+DeviceRange::Predicate
+vendor (VendorID);
+
+/**
+ * Predicate for DeviceRange::filter() that matches devices of given class (bDeviceClass).
+ */
+DeviceRange::Predicate
+device_class (DeviceClass);
+
+/**
+ * Predicate for DeviceRange::filter() that matches devices connected to given bus.
+ */
+DeviceRange::Predicate
+on_bus (uint8_t bus_id);
+
+} // namespace filters
+
+
+inline DeviceView const&
+DeviceRange::Iterator::operator*() const noexcept
+{
+	return _view;
+}
+
+
+inline DeviceView const*
+DeviceRange::Iterator::operator->() const noexcept
+{
+	return &_view;
+}
+
+
+inline bool
+DeviceRange::Iterator::operator== (Iterator const& other) const noexcept
+{
+	return _position == other._position;
+}
+
+
+inline bool
+DeviceRange::Iterator::operator!= (Iterator const& other) const noexcept
+{
+	return !(*this == other);
+}
+
+
+/**
+ * File descriptor libusb needs to be polled, for integration
+ * with external event loops. See Bus::pollfds().
+ */
+class PollFD
+{
+  public:
+	int		fd;
+	// Events to poll for (POLLIN, POLLOUT):
+	short	events;
+};
+
+
+typedef std::vector<PollFD> PollFDs;
+
+
+/**
+ * Scheduling settings of Bus's event thread.
+ */
+class EventThreadConfig
+{
+  public:
+	// CPUs the thread is allowed to run on. Empty means any CPU.
+	// Supported on Linux only.
+	std::vector<unsigned int>	cpu_affinity;
+	// Run the thread with SCHED_FIFO policy with this priority (1…99).
+	// Usually requires CAP_SYS_NICE or RLIMIT_RTPRIO. Unset means
+	// the default policy inherited from the starting thread.
+	Optional<int>				fifo_priority;
+};
+
+
+/**
+ * Represents libusb session.
+ * http://libusb.sourceforge.net/api-1.0/contexts.html
+ * All HotplugSubscriptions must be deleted before Bus is deleted.
+ */
+class Bus
+{
+  public:
+	// Ctor
+	Bus();
+
+	// Dtor
+	~Bus();
+
+	/**
+	 * Return libusb context pointer.
+	 */
+	libusb_context*
+	get_libusb_context() const noexcept;
+
+	/**
+	 * Return list of devices detected in the system.
+	 * The list is part of the cached snapshot, see snapshot().
+	 */
+	Shared<DeviceDescriptors const>
+	device_descriptors() const;
+
+	/**
+	 * Enumerate devices and return range that can be lazily filtered, eg.:
+	 *   bus.devices().filter (filters::vid_pid (0x1234, 0x5678)).first();
+	 * Unlike device_descriptors(), always enumerates devices.
+	 */
+	DeviceRange
+	devices() const;
+
+	/**
+	 * Return immutable tree of devices detected in the system.
+	 * The snapshot is cached and shared between callers. Devices are enumerated
+	 * again only after the generation number has been bumped by refresh() or
+	 * by a hotplug event (while the event thread is running).
+	 */
+	Shared<Snapshot const>
+	snapshot() const;
+
+	/**
+	 * Return current generation number. It's incremented every time the list
+	 * of devices is considered outdated.
+	 */
+	uint64_t
+	generation() const noexcept;
+
+	/**
+	 * Mark cached snapshot as outdated. Next call to snapshot()
+	 * or device_descriptors() will enumerate devices again.
+	 */
+	void
+	refresh() noexcept;
+
+	/**
+	 * Find and return DeviceDescriptor with specified address.
+	 * Matches address only, so on systems with multiple buses it may return
+	 * a device from any of them. Prefer the bus_id variant.
+	 */
+	Optional<DeviceDescriptor>
+	find_by_address (uint8_t address) const;
+
+	/**
+	 * Find and return DeviceDescriptor with specified bus number and address.
+	 * For repeated lookups use DeviceIndex.
+	 */
+	Optional<DeviceDescriptor>
+	find_by_address (uint8_t bus_id, uint8_t address) const;
+
+	/**
+	 * Start the thread that handles libusb events, unless it's already running.
+	 * Calls are counted, the thread is stopped when release_event_thread()
+	 * has been called the same number of times.
+	 *
+	 * The thread runs libusb_handle_events_timeout_completed() in a loop and
+	 * is woken up for shutdown with libusb_interrupt_event_handler(). Transfer
+	 * callbacks are called from it. See also EventThreadGuard and
+	 * set_event_thread_config().
+	 *
+	 * While the thread runs, hotplug events (if supported by the platform)
+	 * bump the generation number.
+	 *
+	 * While external event handling is acquired, the thread isn't run
+	 * and calls are only counted. See acquire_external_event_handling().
+	 */
+	void
+	acquire_event_thread();
+
+	/**
+	 * Counterpart of acquire_event_thread().
+	 * Must not be called from within the event thread.
+	 */
+	void
+	release_event_thread();
+
+	/**
+	 * Hand over libusb event handling to an external event loop, which
+	 * calls process_ready() on its own (like asio::EventDriver). Calls are
+	 * counted. The event thread is stopped if it's running and isn't started
+	 * again until release_external_event_handling() has been called the same
+	 * number of times. Until then hotplug events (and callbacks of
+	 * HotplugSubscriptions) are delivered from within process_ready().
+	 * Must not be called from within the event thread.
+	 * May throw StatusException.
+	 */
+	void
+	acquire_external_event_handling();
+
+	/**
+	 * Counterpart of acquire_external_event_handling(). Restarts the event
+	 * thread if it has been acquired in the meantime.
+	 * May throw Exception if the thread can't be started.
+	 */
+	void
+	release_external_event_handling();
+
+	/**
+	 * Return true if called from the event thread.
+	 */
+	bool
+	in_event_thread() const noexcept;
+
+	/**
+	 * Return scheduling settings of the event thread.
+	 */
+	EventThreadConfig
+	event_thread_config() const;
+
+	/**
+	 * Set scheduling settings of the event thread. Applied immediately
+	 * if the thread is running, otherwise when it's started.
+	 * Throws Exception if settings can't be applied to the running thread;
+	 * the previous settings are kept then.
+	 */
+	void
+	set_event_thread_config (EventThreadConfig const&);
+
+	/**
+	 * Return file descriptors that need to be polled for libusb events,
+	 * for use with an external event loop instead of the event thread.
+	 * Use PollFDNotifier to be notified about changes.
+	 * May throw StatusException.
+	 */
+	PollFDs
+	pollfds() const;
+
+	/**
+	 * Return true if expiring timeouts are signalled through one of the pollfds(),
+	 * so that next_timeout() doesn't need to be used.
+	 */
+	bool
+	pollfds_handle_timeouts() const noexcept;
+
+	/**
+	 * Return time after which process_ready() must be called to handle
+	 * timeouts, even if none of the pollfds() became ready. Zero means it
+	 * should be called immediately. Empty result means no pending timeouts.
+	 * May throw StatusException.
+	 */
+	Optional<std::chrono::microseconds>
+	next_timeout() const;
+
+	/**
+	 * Handle pending libusb events without blocking: call libusb_handle_events_timeout()
+	 * with zero timeout. Call it when any of the pollfds() becomes ready or
+	 * next_timeout() expires. Transfer callbacks are called from within.
+	 * May throw StatusException.
+	 */
+	void
+	process_ready();
+
+	/**
+	 * Return true if the platform supports hotplug notifications.
+	 */
+	static bool
+	has_hotplug() noexcept;
+
+	/**
+	 * Return poller used for hotplug notifications on platforms without
+	 * hotplug support. Created on first use.
+	 */
+	HotplugPoller&
+	hotplug_poller();
+
+  private:
+	/**
+	 * Start/stop the event thread.
+	 * Must be called with _event_thread_mutex locked.
+	 */
+	void
+	start_event_thread();
+
+	void
+	stop_event_thread();
+
+	/**
+	 * Stop and join the event thread, but keep the hotplug callback.
+	 * Must be called with _event_thread_mutex locked.
+	 */
+	void
+	join_event_thread();
+
+	/**
+	 * Register hotplug callback that bumps the generation number,
+	 * if the platform supports hotplug and it's not registered yet.
+	 */
+	void
+	register_hotplug_refresh();
+
+	/**
+	 * Deregister the hotplug callback, if registered.
+	 */
+	void
+	deregister_hotplug_refresh() noexcept;
+
+	/**
+	 * Event thread body.
+	 */
+	void
+	handle_events();
+
+	/**
+	 * Apply scheduling settings to the event thread.
+	 * Must be called with _event_thread_mutex locked.
+	 */
+	void
+	apply_event_thread_config (EventThreadConfig const&);
+
+	/**
+	 * Hotplug callback that bumps the generation number.
+	 */
+	static int LIBUSB_CALL
+	hotplug_refresh (libusb_context*, libusb_device*, libusb_hotplug_event, void* user_data);
+
+  private:
+	libusb_context*					_context;
+	std::atomic<uint64_t>			_generation				{ 1 };
+	std::mutex mutable				_snapshot_mutex;
+	Shared<Snapshot const> mutable	_snapshot;
+	std::mutex mutable				_event_thread_mutex;
+	EventThreadConfig				_event_thread_config;
+	std::size_t						_event_thread_users		= 0;
+	std::size_t						_external_event_handlers	= 0;
+	std::thread						_event_thread;
+	std::atomic<bool>				_event_thread_stop		{ false };
+	Optional<libusb_hotplug_callback_handle>
+									_hotplug_refresh_handle;
+	std::mutex						_hotplug_poller_mutex;
+	std::unique_ptr<HotplugPoller>	_hotplug_poller;
+};
+
+
+/**
+ * RAII-style wrapper for Bus::acquire_event_thread() +
+ * Bus::release_event_thread(). Keeps the event thread running
+ * for as long as it exists.
+ */
+class EventThreadGuard
+{
+  public:
+	/**
+	 * Ctor
+	 * Throws Exception if the thread can't be started.
+	 */
+	explicit EventThreadGuard (Bus&);
+
+	EventThreadGuard (EventThreadGuard const&) = delete;
+
+	// Dtor
+	~EventThreadGuard();
+
+	EventThreadGuard&
+	operator= (EventThreadGuard const&) = delete;
+
+  private:
+	Bus& _bus;
+};
+
+
+inline libusb_context*
+Bus::get_libusb_context() const noexcept
+{
+	return _context;
+}
+
+
+inline uint64_t
+Bus::generation() const noexcept
+{
+	return _generation.load();
+}
+
+
+inline void
+Bus::refresh() noexcept
+{
+	++_generation;
+}
+
+
+inline bool
+Bus::in_event_thread() const noexcept
+{
+	return _event_thread.get_id() == std::this_thread::get_id();
+}
+
+
+inline bool
+Bus::pollfds_handle_timeouts() const noexcept
+{
+	return libusb_pollfds_handle_timeouts (_context) != 0;
+}
+
+
+inline bool
+Bus::has_hotplug() noexcept
+{
+	return libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG);
+}
+
+
+inline
+EventThreadGuard::EventThreadGuard (Bus& bus):
+	_bus (bus)
+{
+	_bus.acquire_event_thread();
+}
+
+
+inline
+EventThreadGuard::~EventThreadGuard()
+{
+	_bus.release_event_thread();
+}
+
+
+constexpr
+ControlTransfer::ControlTransfer (uint8_t request, uint16_t value, uint16_t index,
+								  RequestType type, Recipient recipient, Direction direction) noexcept:
+	request (request),
+	value (value),
+	index (index),
+	type (type),
+	recipient (recipient),
+	direction (direction)
+{ }
+
+
+constexpr uint8_t
+ControlTransfer::request_type() const noexcept
+{
+	return make_request_type (type, recipient, direction);
+}
+
+
+constexpr uint8_t
+ControlTransfer::request_type (Direction direction) const noexcept
+{
+	return make_request_type (type, recipient, direction);
+}
+
+
+template<RequestType Type, Recipient Recip, Direction Dir, uint8_t Request>
+	inline void
+	Device::send (ControlRequest<Type, Recip, Dir, Request> const& cr, int timeout_ms, Span<uint8_t const> buffer)
+	{
+		static_assert (Dir == Direction::Out, "send() requires an Out request");
+
+		control_transfer (cr.request_type, cr.request, cr.value, cr.index,
+						  const_cast<uint8_t*> (buffer.data()), buffer.size(), timeout_ms);
+	}
+
+
+template<RequestType Type, Recipient Recip, Direction Dir, uint8_t Request>
+	inline std::size_t
+	Device::receive (ControlRequest<Type, Recip, Dir, Request> const& cr, Span<uint8_t> buffer, int timeout_ms)
+	{
+		static_assert (Dir == Direction::In, "receive() requires an In request");
+
+		return control_transfer (cr.request_type, cr.request, cr.value, cr.index,
+								 buffer.data(), buffer.size(), timeout_ms);
+	}
+
+
+inline libusb_device_handle*
+Device::get_libusb_handle() const noexcept
+{
+	return _handle ? _handle->get() : nullptr;
+}
+
+
+/**
+ * Return true if an int returned by libusb function
+ * is an error status code.
+ */
+bool
+is_error (int status);
 
 } // namespace libusb
 
+
+namespace std {
+
+template<>
+	struct hash<libusb::DeviceKey>
+	{
+		std::size_t
+		operator() (libusb::DeviceKey const& key) const noexcept
+		{
+			return key.hash();
+		}
+	};
+
+
+template<>
+	struct hash<libusb::DeviceDescriptor>
+	{
+		std::size_t
+		operator() (libusb::DeviceDescriptor const& descriptor) const noexcept
+		{
+			return std::hash<libusb_device*>() (descriptor.get_libusb_device());
+		}
+	};
+
+} // namespace std
+
 #endif
 
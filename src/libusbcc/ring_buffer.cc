@@ -0,0 +1,69 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+
+// Local:
+#include "ring_buffer.h"
+
+
+namespace libusb {
+
+RingBuffer::RingBuffer (std::size_t capacity)
+{
+	std::size_t size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	_data.resize (size);
+	_mask = size - 1;
+}
+
+
+std::size_t
+RingBuffer::write (Span<uint8_t const> data) noexcept
+{
+	auto const head = _head.load (std::memory_order_relaxed);
+	auto const tail = _tail.load (std::memory_order_acquire);
+	auto const n = std::min (data.size(), capacity() - (head - tail));
+	auto const offset = head & _mask;
+	// Data may wrap around the end of the buffer:
+	auto const first = std::min (n, capacity() - offset);
+
+	std::copy (data.begin(), data.begin() + first, _data.begin() + offset);
+	std::copy (data.begin() + first, data.begin() + n, _data.begin());
+	_head.store (head + n, std::memory_order_release);
+
+	return n;
+}
+
+
+std::size_t
+RingBuffer::read (Span<uint8_t> buffer) noexcept
+{
+	auto const tail = _tail.load (std::memory_order_relaxed);
+	auto const head = _head.load (std::memory_order_acquire);
+	auto const n = std::min (buffer.size(), head - tail);
+	auto const offset = tail & _mask;
+	auto const first = std::min (n, capacity() - offset);
+
+	std::copy (_data.begin() + offset, _data.begin() + offset + first, buffer.begin());
+	std::copy (_data.begin(), _data.begin() + (n - first), buffer.begin() + first);
+	_tail.store (tail + n, std::memory_order_release);
+
+	return n;
+}
+
+} // namespace libusb
@@ -0,0 +1,118 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__RING_BUFFER_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__RING_BUFFER_H__INCLUDED
+
+// Standard:
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * Lock-free single-producer, single-consumer ring buffer of bytes.
+ * write() may be called from one thread and read() from another,
+ * concurrently, without locks or allocations.
+ */
+class RingBuffer
+{
+	// Keeps producer and consumer indexes in separate cache lines:
+	static constexpr std::size_t CacheLineSize = 64;
+
+  public:
+	/**
+	 * Ctor
+	 * Capacity is rounded up to a power of two.
+	 */
+	explicit RingBuffer (std::size_t capacity);
+
+	RingBuffer (RingBuffer const&) = delete;
+
+	RingBuffer&
+	operator= (RingBuffer const&) = delete;
+
+	/**
+	 * Return capacity in bytes.
+	 */
+	std::size_t
+	capacity() const noexcept;
+
+	/**
+	 * Return number of bytes that can be read.
+	 * Exact when called by the consumer, a lower bound otherwise.
+	 */
+	std::size_t
+	read_available() const noexcept;
+
+	/**
+	 * Return number of bytes that can be written.
+	 * Exact when called by the producer, a lower bound otherwise.
+	 */
+	std::size_t
+	write_available() const noexcept;
+
+	/**
+	 * Append as much of data as fits. Producer only.
+	 * Return number of bytes written.
+	 */
+	std::size_t
+	write (Span<uint8_t const> data) noexcept;
+
+	/**
+	 * Take up to buffer.size() bytes. Consumer only.
+	 * Return number of bytes read.
+	 */
+	std::size_t
+	read (Span<uint8_t> buffer) noexcept;
+
+  private:
+	std::vector<uint8_t>		_data;
+	std::size_t					_mask;
+	// Total bytes written, modified by the producer only:
+	std::atomic<std::size_t>	_head		{ 0 };
+	char						_padding[CacheLineSize - sizeof (std::atomic<std::size_t>)];
+	// Total bytes read, modified by the consumer only:
+	std::atomic<std::size_t>	_tail		{ 0 };
+};
+
+
+inline std::size_t
+RingBuffer::capacity() const noexcept
+{
+	return _data.size();
+}
+
+
+inline std::size_t
+RingBuffer::read_available() const noexcept
+{
+	return _head.load (std::memory_order_acquire) - _tail.load (std::memory_order_acquire);
+}
+
+
+inline std::size_t
+RingBuffer::write_available() const noexcept
+{
+	return capacity() - read_available();
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,77 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "snapshot.h"
+
+
+namespace libusb {
+
+Snapshot::Node::Node (DeviceDescriptor const& descriptor):
+	_descriptor (&descriptor),
+	_port_path (descriptor.port_path())
+{ }
+
+
+Snapshot::Snapshot (libusb_context* context, uint64_t generation):
+	_generation (generation)
+{
+	low_level::DeviceList devices (context);
+
+	// Reserve upfront, nodes point to descriptors and to each other:
+	_descriptors.reserve (devices.size());
+	_nodes.reserve (devices.size());
+	_by_device.reserve (devices.size());
+
+	for (auto const& d: devices)
+	{
+		_descriptors.emplace_back (d);
+		_nodes.emplace_back (_descriptors.back());
+		_by_device[d] = &_nodes.back();
+	}
+
+	// libusb_get_parent() is only valid while the device list is alive:
+	for (auto& node: _nodes)
+	{
+		auto found = _by_device.find (libusb_get_parent (node._descriptor->get_libusb_device()));
+
+		if (found != _by_device.end())
+		{
+			node._parent = found->second;
+			found->second->_children.push_back (&node);
+		}
+		else
+			_roots.push_back (&node);
+	}
+
+	for (auto& node: _nodes)
+		for (Node const* p = node._parent; p; p = p->_parent)
+			++node._depth;
+}
+
+
+Snapshot::Node const*
+Snapshot::find (libusb_device* device) const noexcept
+{
+	auto found = _by_device.find (device);
+
+	if (found != _by_device.end())
+		return found->second;
+	else
+		return nullptr;
+}
+
+} // namespace libusb
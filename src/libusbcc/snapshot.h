@@ -0,0 +1,289 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__SNAPSHOT_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__SNAPSHOT_H__INCLUDED
+
+// Standard:
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+/**
+ * Immutable tree of USB devices obtained in a single enumeration pass.
+ * Parent/child links, port paths and depths are computed upfront,
+ * so walking the hierarchy never calls into libusb.
+ *
+ * Nodes refer to each other by pointers, so Snapshot can't be copied.
+ * Share it with Shared<Snapshot const> instead.
+ */
+class Snapshot
+{
+  public:
+	class Node
+	{
+		friend class Snapshot;
+
+	  public:
+		// Ctor
+		explicit Node (DeviceDescriptor const&);
+
+		/**
+		 * Return DeviceDescriptor of the device.
+		 */
+		DeviceDescriptor const&
+		descriptor() const noexcept;
+
+		/**
+		 * Return non-owning view of the device.
+		 * The view is valid for as long as the Snapshot exists.
+		 */
+		DeviceView
+		view() const noexcept;
+
+		/**
+		 * Return parent node or nullptr for root hubs.
+		 */
+		Node const*
+		parent() const noexcept;
+
+		/**
+		 * Return list of devices connected directly to this one.
+		 */
+		std::vector<Node const*> const&
+		children() const noexcept;
+
+		/**
+		 * Return port numbers from the root hub down to this device.
+		 */
+		PortPath const&
+		port_path() const noexcept;
+
+		/**
+		 * Return distance from the root hub. Root hubs have depth 0.
+		 */
+		std::size_t
+		depth() const noexcept;
+
+		/**
+		 * Return true if node has no parent.
+		 */
+		bool
+		is_root() const noexcept;
+
+	  private:
+		DeviceDescriptor const*		_descriptor;
+		Node const*					_parent		= nullptr;
+		std::vector<Node const*>	_children;
+		PortPath					_port_path;
+		std::size_t					_depth		= 0;
+	};
+
+	typedef std::vector<Node> Nodes;
+
+  public:
+	/**
+	 * Ctor
+	 * Enumerates devices. May throw StatusException.
+	 *
+	 * \param	generation
+	 * 			Bus generation number at the moment of enumeration.
+	 */
+	explicit Snapshot (libusb_context*, uint64_t generation = 0);
+
+	Snapshot (Snapshot const&) = delete;
+
+	Snapshot&
+	operator= (Snapshot const&) = delete;
+
+	/**
+	 * Return Bus generation number this snapshot was taken at.
+	 */
+	uint64_t
+	generation() const noexcept;
+
+	/**
+	 * Return descriptors of all devices in enumeration order.
+	 */
+	DeviceDescriptors const&
+	descriptors() const noexcept;
+
+	/**
+	 * Return all nodes in enumeration order.
+	 */
+	Nodes const&
+	nodes() const noexcept;
+
+	/**
+	 * Return nodes that have no parent (root hubs).
+	 */
+	std::vector<Node const*> const&
+	roots() const noexcept;
+
+	/**
+	 * Find node for given libusb device.
+	 * Return nullptr if device is not part of the snapshot.
+	 */
+	Node const*
+	find (libusb_device*) const noexcept;
+
+	/**
+	 * Find node for given DeviceDescriptor.
+	 * Return nullptr if device is not part of the snapshot.
+	 */
+	Node const*
+	find (DeviceDescriptor const&) const noexcept;
+
+	/**
+	 * Return number of devices.
+	 */
+	std::size_t
+	size() const noexcept;
+
+	/**
+	 * Return first node iterator.
+	 */
+	Nodes::const_iterator
+	begin() const noexcept;
+
+	/**
+	 * Return after-the-last node iterator.
+	 */
+	Nodes::const_iterator
+	end() const noexcept;
+
+  private:
+	uint64_t									_generation;
+	DeviceDescriptors							_descriptors;
+	Nodes										_nodes;
+	std::vector<Node const*>					_roots;
+	std::unordered_map<libusb_device*, Node*>	_by_device;
+};
+
+
+inline DeviceDescriptor const&
+Snapshot::Node::descriptor() const noexcept
+{
+	return *_descriptor;
+}
+
+
+inline DeviceView
+Snapshot::Node::view() const noexcept
+{
+	return _descriptor->view();
+}
+
+
+inline Snapshot::Node const*
+Snapshot::Node::parent() const noexcept
+{
+	return _parent;
+}
+
+
+inline std::vector<Snapshot::Node const*> const&
+Snapshot::Node::children() const noexcept
+{
+	return _children;
+}
+
+
+inline PortPath const&
+Snapshot::Node::port_path() const noexcept
+{
+	return _port_path;
+}
+
+
+inline std::size_t
+Snapshot::Node::depth() const noexcept
+{
+	return _depth;
+}
+
+
+inline bool
+Snapshot::Node::is_root() const noexcept
+{
+	return !_parent;
+}
+
+
+inline uint64_t
+Snapshot::generation() const noexcept
+{
+	return _generation;
+}
+
+
+inline DeviceDescriptors const&
+Snapshot::descriptors() const noexcept
+{
+	return _descriptors;
+}
+
+
+inline Snapshot::Nodes const&
+Snapshot::nodes() const noexcept
+{
+	return _nodes;
+}
+
+
+inline std::vector<Snapshot::Node const*> const&
+Snapshot::roots() const noexcept
+{
+	return _roots;
+}
+
+
+inline Snapshot::Node const*
+Snapshot::find (DeviceDescriptor const& descriptor) const noexcept
+{
+	return find (descriptor.get_libusb_device());
+}
+
+
+inline std::size_t
+Snapshot::size() const noexcept
+{
+	return _nodes.size();
+}
+
+
+inline Snapshot::Nodes::const_iterator
+Snapshot::begin() const noexcept
+{
+	return _nodes.begin();
+}
+
+
+inline Snapshot::Nodes::const_iterator
+Snapshot::end() const noexcept
+{
+	return _nodes.end();
+}
+
+} // namespace libusb
+
+#endif
@@ -0,0 +1,324 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+#include <exception>
+#include <limits>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "transfer.h"
+
+
+namespace libusb {
+
+libusb_error
+to_error (TransferStatus status)
+{
+	switch (status)
+	{
+		case TransferStatus::Completed:
+			return LIBUSB_SUCCESS;
+		case TransferStatus::TimedOut:
+			return LIBUSB_ERROR_TIMEOUT;
+		case TransferStatus::Cancelled:
+			return LIBUSB_ERROR_INTERRUPTED;
+		case TransferStatus::Stall:
+			return LIBUSB_ERROR_PIPE;
+		case TransferStatus::NoDevice:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case TransferStatus::Overflow:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+
+Transfer::Transfer (Shared<low_level::DeviceHandle> handle, int iso_packets):
+	_handle (handle),
+	_transfer (libusb_alloc_transfer (iso_packets)),
+	_iso_packets (iso_packets)
+{
+	if (!_transfer)
+		throw StatusException (LIBUSB_ERROR_NO_MEM);
+}
+
+
+Shared<Transfer>
+Transfer::create (Device const& device, int iso_packets)
+{
+	if (!device._handle)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	// Ctor is private, so std::make_shared() can't be used:
+	return Shared<Transfer> (new Transfer (device._handle, iso_packets));
+}
+
+
+Transfer::~Transfer()
+{
+	// Can't be in flight here, since in-flight transfers keep themselves alive.
+	libusb_free_transfer (_transfer);
+}
+
+
+void
+Transfer::fill_control_write (ControlTransfer const& ct, Span<uint8_t const> data, int timeout_ms)
+{
+	fill_control (ct.request_type (Direction::Out), ct, Span<uint8_t> (static_cast<uint8_t*> (nullptr), data.size()), timeout_ms);
+	_buffer = { _control_buffer.data() + LIBUSB_CONTROL_SETUP_SIZE, data.size() };
+	std::copy (data.begin(), data.end(), _buffer.begin());
+}
+
+
+void
+Transfer::fill_control_read (ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms)
+{
+	fill_control (ct.request_type (Direction::In), ct, buffer, timeout_ms);
+}
+
+
+void
+Transfer::fill_bulk_write (uint8_t endpoint, Span<uint8_t const> data, int timeout_ms)
+{
+	// For to-device transfers the buffer is not modified:
+	fill (TransferType::Bulk, endpoint & ~LIBUSB_ENDPOINT_IN, { const_cast<uint8_t*> (data.data()), data.size() }, timeout_ms);
+}
+
+
+void
+Transfer::fill_bulk_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms)
+{
+	fill (TransferType::Bulk, endpoint | LIBUSB_ENDPOINT_IN, buffer, timeout_ms);
+}
+
+
+void
+Transfer::fill_bulk_stream_write (uint8_t endpoint, uint32_t stream_id, Span<uint8_t const> data, int timeout_ms)
+{
+	// For to-device transfers the buffer is not modified:
+	fill (TransferType::Bulk, endpoint & ~LIBUSB_ENDPOINT_IN, { const_cast<uint8_t*> (data.data()), data.size() }, timeout_ms, stream_id);
+}
+
+
+void
+Transfer::fill_bulk_stream_read (uint8_t endpoint, uint32_t stream_id, Span<uint8_t> buffer, int timeout_ms)
+{
+	fill (TransferType::Bulk, endpoint | LIBUSB_ENDPOINT_IN, buffer, timeout_ms, stream_id);
+}
+
+
+void
+Transfer::fill_interrupt_write (uint8_t endpoint, Span<uint8_t const> data, int timeout_ms)
+{
+	// For to-device transfers the buffer is not modified:
+	fill (TransferType::Interrupt, endpoint & ~LIBUSB_ENDPOINT_IN, { const_cast<uint8_t*> (data.data()), data.size() }, timeout_ms);
+}
+
+
+void
+Transfer::fill_interrupt_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms)
+{
+	fill (TransferType::Interrupt, endpoint | LIBUSB_ENDPOINT_IN, buffer, timeout_ms);
+}
+
+
+void
+Transfer::fill_iso_write (uint8_t endpoint, Span<uint8_t const> data, std::size_t packet_length, int timeout_ms)
+{
+	// For to-device transfers the buffer is not modified:
+	fill_iso (endpoint & ~LIBUSB_ENDPOINT_IN, { const_cast<uint8_t*> (data.data()), data.size() }, packet_length, timeout_ms);
+}
+
+
+void
+Transfer::fill_iso_read (uint8_t endpoint, Span<uint8_t> buffer, std::size_t packet_length, int timeout_ms)
+{
+	fill_iso (endpoint | LIBUSB_ENDPOINT_IN, buffer, packet_length, timeout_ms);
+}
+
+
+void
+Transfer::submit (Callback callback)
+{
+	check_not_in_flight();
+	_callback = std::move (callback);
+	resubmit();
+}
+
+
+std::future<std::size_t>
+Transfer::submit()
+{
+	auto promise = std::make_shared<std::promise<std::size_t>>();
+	auto future = promise->get_future();
+
+	submit ([promise](Transfer& transfer) {
+		if (transfer.status() == TransferStatus::Completed)
+			promise->set_value (transfer.actual_length());
+		else
+			promise->set_exception (std::make_exception_ptr (StatusException (to_error (transfer.status()))));
+	});
+
+	return future;
+}
+
+
+void
+Transfer::resubmit()
+{
+	check_not_in_flight();
+
+	_self = shared_from_this();
+	_in_flight.store (true, std::memory_order_release);
+	_handle->add_in_flight (_transfer);
+
+	int err = libusb_submit_transfer (_transfer);
+
+	if (is_error (err))
+	{
+		_handle->remove_in_flight (_transfer);
+		_in_flight.store (false, std::memory_order_release);
+		_self.reset();
+		throw StatusException (static_cast<libusb_error> (err));
+	}
+}
+
+
+bool
+Transfer::cancel() noexcept
+{
+	return in_flight() && libusb_cancel_transfer (_transfer) == LIBUSB_SUCCESS;
+}
+
+
+void
+Transfer::check_not_in_flight() const
+{
+	if (in_flight())
+		throw StatusException (LIBUSB_ERROR_BUSY);
+}
+
+
+void
+Transfer::fill (TransferType type, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms, Optional<uint32_t> stream_id)
+{
+	check_not_in_flight();
+
+	if (buffer.size() > static_cast<std::size_t> (std::numeric_limits<int>::max()))
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_buffer = buffer;
+
+	if (type == TransferType::Interrupt)
+		libusb_fill_interrupt_transfer (_transfer, _handle->get(), endpoint, buffer.data(), static_cast<int> (buffer.size()),
+										&Transfer::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+	else if (stream_id)
+		libusb_fill_bulk_stream_transfer (_transfer, _handle->get(), endpoint, *stream_id, buffer.data(), static_cast<int> (buffer.size()),
+										  &Transfer::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+	else
+		libusb_fill_bulk_transfer (_transfer, _handle->get(), endpoint, buffer.data(), static_cast<int> (buffer.size()),
+								   &Transfer::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+}
+
+
+void
+Transfer::fill_control (uint8_t request_type, ControlTransfer const& ct, Span<uint8_t> buffer, int timeout_ms)
+{
+	check_not_in_flight();
+
+	// wLength is 16-bit:
+	if (buffer.size() > std::numeric_limits<uint16_t>::max())
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	// Only grows, so refilling with the same or smaller size doesn't allocate:
+	if (_control_buffer.size() < LIBUSB_CONTROL_SETUP_SIZE + buffer.size())
+		_control_buffer.resize (LIBUSB_CONTROL_SETUP_SIZE + buffer.size());
+
+	_buffer = buffer;
+
+	libusb_fill_control_setup (_control_buffer.data(), request_type, ct.request, ct.value, ct.index, static_cast<uint16_t> (buffer.size()));
+	libusb_fill_control_transfer (_transfer, _handle->get(), _control_buffer.data(),
+								  &Transfer::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+}
+
+
+void
+Transfer::fill_iso (uint8_t endpoint, Span<uint8_t> buffer, std::size_t packet_length, int timeout_ms)
+{
+	check_not_in_flight();
+
+	auto const packets = static_cast<std::size_t> (_iso_packets);
+
+	if (packets == 0 || packet_length == 0 || packet_length > std::numeric_limits<unsigned int>::max())
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	if (buffer.size() / packets < packet_length)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	auto const length = packets * packet_length;
+
+	if (length > static_cast<std::size_t> (std::numeric_limits<int>::max()))
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	_buffer = buffer.subspan (0, length);
+	_iso_packet_length = packet_length;
+
+	libusb_fill_iso_transfer (_transfer, _handle->get(), endpoint, buffer.data(), static_cast<int> (length), _iso_packets,
+							  &Transfer::handle_completion, this, static_cast<unsigned int> (timeout_ms));
+	libusb_set_iso_packet_lengths (_transfer, static_cast<unsigned int> (packet_length));
+}
+
+
+void LIBUSB_CALL
+Transfer::handle_completion (libusb_transfer* transfer)
+{
+	auto self = static_cast<Transfer*> (transfer->user_data);
+	// Keep the Transfer alive until the callback returns:
+	auto keep_alive = std::move (self->_self);
+
+	self->_handle->remove_in_flight (transfer);
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL && (self->_control_buffer[0] & LIBUSB_ENDPOINT_IN) && self->_buffer.data())
+	{
+		auto const length = std::min<std::size_t> (transfer->actual_length, self->_buffer.size());
+		auto const data = libusb_control_transfer_get_data (transfer);
+		std::copy (data, data + length, self->_buffer.data());
+	}
+
+	self->_in_flight.store (false, std::memory_order_release);
+
+	// Move the callback out, so that it can replace itself by calling submit():
+	auto callback = std::move (self->_callback);
+	self->_callback = nullptr;
+
+	if (callback)
+	{
+		try {
+			callback (*self);
+		}
+		catch (...)
+		{
+			// Exceptions can't be propagated to the event thread.
+		}
+	}
+
+	if (!self->_callback)
+		self->_callback = std::move (callback);
+}
+
+} // namespace libusb
@@ -0,0 +1,384 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__TRANSFER_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__TRANSFER_H__INCLUDED
+
+// Standard:
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+
+
+namespace libusb {
+
+enum class TransferStatus: uint8_t
+{
+	Completed	= LIBUSB_TRANSFER_COMPLETED,
+	Error		= LIBUSB_TRANSFER_ERROR,
+	TimedOut	= LIBUSB_TRANSFER_TIMED_OUT,
+	Cancelled	= LIBUSB_TRANSFER_CANCELLED,
+	Stall		= LIBUSB_TRANSFER_STALL,
+	NoDevice	= LIBUSB_TRANSFER_NO_DEVICE,
+	Overflow	= LIBUSB_TRANSFER_OVERFLOW,
+};
+
+
+/**
+ * Return libusb error code corresponding to transfer status.
+ * LIBUSB_SUCCESS for TransferStatus::Completed.
+ */
+libusb_error
+to_error (TransferStatus);
+
+
+/**
+ * Asynchronous transfer: RAII-style wrapper for libusb_alloc_transfer() +
+ * libusb_free_transfer(), with libusb_submit_transfer() and
+ * libusb_cancel_transfer().
+ *
+ * Completion callbacks are called from whichever thread handles libusb
+ * events on the Bus, typically the Bus's event thread. A handful of such
+ * threads can drive any number of transfers on any number of devices.
+ *
+ * Transfers are always owned by Shared<> pointers (see create()). While
+ * in flight, a Transfer keeps itself alive, so the last external reference
+ * may be dropped at any time. Each Transfer also keeps the device handle
+ * open: destroying the Device cancels in-flight transfers, and the handle
+ * is closed when the last Transfer is gone.
+ *
+ * Buffers passed to fill_*() are not copied (except for control transfers,
+ * which need room for the setup packet) and must stay valid until the
+ * transfer completes. A Transfer can be refilled and resubmitted after it
+ * completes, without allocating.
+ *
+ * Isochronous transfers need packet descriptors, allocated by create().
+ * Their results are reported per packet, see iso_packet().
+ */
+class Transfer: public std::enable_shared_from_this<Transfer>
+{
+  public:
+	/**
+	 * Called on completion, including failed and cancelled transfers;
+	 * check status(). Must not throw (exceptions are swallowed).
+	 * The callback may resubmit the transfer.
+	 */
+	typedef std::function<void (Transfer&)> Callback;
+
+	/**
+	 * Result of a single packet of an isochronous transfer.
+	 */
+	class IsoPacket
+	{
+	  public:
+		TransferStatus	status;
+		// Received data (In) or sent data (Out), actual length:
+		Span<uint8_t>	data;
+	};
+
+  public:
+	/**
+	 * Create transfer for given device.
+	 * Throws StatusException (LIBUSB_ERROR_NO_MEM) if allocation fails.
+	 *
+	 * \param	iso_packets
+	 * 			Number of isochronous packet descriptors to allocate.
+	 * 			0 for non-isochronous transfers.
+	 */
+	static Shared<Transfer>
+	create (Device const&, int iso_packets = 0);
+
+	Transfer (Transfer const&) = delete;
+
+	// Dtor
+	~Transfer();
+
+	Transfer&
+	operator= (Transfer const&) = delete;
+
+	/**
+	 * Prepare control transfer to the device (Out direction).
+	 * Data is copied, so the buffer doesn't need to outlive this call.
+	 */
+	void
+	fill_control_write (ControlTransfer const&, Span<uint8_t const> data, int timeout_ms = 0);
+
+	/**
+	 * Prepare control transfer from the device (In direction). wLength
+	 * is the size of the buffer. Received data is copied into the buffer
+	 * before the callback is called.
+	 */
+	void
+	fill_control_read (ControlTransfer const&, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Prepare bulk transfer to the device. The direction bit of endpoint is cleared.
+	 */
+	void
+	fill_bulk_write (uint8_t endpoint, Span<uint8_t const> data, int timeout_ms = 0);
+
+	/**
+	 * Prepare bulk transfer from the device. The direction bit of endpoint is set.
+	 */
+	void
+	fill_bulk_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Prepare bulk transfer to the device on given bulk stream (see BulkStreams).
+	 * The direction bit of endpoint is cleared.
+	 */
+	void
+	fill_bulk_stream_write (uint8_t endpoint, uint32_t stream_id, Span<uint8_t const> data, int timeout_ms = 0);
+
+	/**
+	 * Prepare bulk transfer from the device on given bulk stream (see BulkStreams).
+	 * The direction bit of endpoint is set.
+	 */
+	void
+	fill_bulk_stream_read (uint8_t endpoint, uint32_t stream_id, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Prepare interrupt transfer to the device. The direction bit of endpoint is cleared.
+	 */
+	void
+	fill_interrupt_write (uint8_t endpoint, Span<uint8_t const> data, int timeout_ms = 0);
+
+	/**
+	 * Prepare interrupt transfer from the device. The direction bit of endpoint is set.
+	 */
+	void
+	fill_interrupt_read (uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms = 0);
+
+	/**
+	 * Prepare isochronous transfer to the device. The direction bit of endpoint is cleared.
+	 * Uses all packet descriptors allocated by create(), each packet_length bytes long,
+	 * so data must hold at least iso_packets() * packet_length bytes.
+	 */
+	void
+	fill_iso_write (uint8_t endpoint, Span<uint8_t const> data, std::size_t packet_length, int timeout_ms = 0);
+
+	/**
+	 * Prepare isochronous transfer from the device. The direction bit of endpoint is set.
+	 * Buffer is split into iso_packets() packets, packet_length bytes each, so
+	 * it must hold at least iso_packets() * packet_length bytes.
+	 */
+	void
+	fill_iso_read (uint8_t endpoint, Span<uint8_t> buffer, std::size_t packet_length, int timeout_ms = 0);
+
+	/**
+	 * Submit the transfer. The callback is called once it completes.
+	 * May throw StatusException, in which case the callback will not be called.
+	 * Throws StatusException (LIBUSB_ERROR_BUSY) if the transfer is already in flight.
+	 */
+	void
+	submit (Callback);
+
+	/**
+	 * Submit the transfer. The returned future yields the number of bytes
+	 * transferred, or throws StatusException if the transfer didn't complete.
+	 * Don't wait for it from the thread that handles libusb events.
+	 */
+	std::future<std::size_t>
+	submit();
+
+	/**
+	 * Submit the transfer again with the same settings and callback.
+	 * Intended to be called from the callback.
+	 */
+	void
+	resubmit();
+
+	/**
+	 * Request cancellation. The callback is still called, with status
+	 * TransferStatus::Cancelled (or another one, if the transfer finished
+	 * in the meantime). Return false if the transfer wasn't in flight.
+	 */
+	bool
+	cancel() noexcept;
+
+	/**
+	 * Return true if the transfer has been submitted and
+	 * its callback has not been called yet.
+	 */
+	bool
+	in_flight() const noexcept;
+
+	/**
+	 * Return status of the last completed submission.
+	 */
+	TransferStatus
+	status() const noexcept;
+
+	/**
+	 * Return number of bytes transferred by the last completed submission.
+	 * Doesn't include the setup packet of control transfers. Not meaningful
+	 * for isochronous transfers, use iso_packet() instead.
+	 */
+	std::size_t
+	actual_length() const noexcept;
+
+	/**
+	 * Return number of isochronous packet descriptors allocated by create().
+	 */
+	std::size_t
+	iso_packets() const noexcept;
+
+	/**
+	 * Return result of packet with given index (< iso_packets()) of the last
+	 * completed isochronous submission. Packets that weren't received have
+	 * empty data.
+	 */
+	IsoPacket
+	iso_packet (std::size_t index) const noexcept;
+
+	/**
+	 * Return the buffer passed to fill_*().
+	 */
+	Span<uint8_t>
+	buffer() const noexcept;
+
+	/**
+	 * Return the part of buffer() holding actual_length() bytes.
+	 */
+	Span<uint8_t>
+	data() const noexcept;
+
+	/**
+	 * Return the underlying libusb transfer, for use with libusb functions
+	 * not wrapped by this class. Don't change its callback or user_data.
+	 */
+	libusb_transfer*
+	get_libusb_transfer() const noexcept;
+
+  private:
+	// Ctor
+	explicit Transfer (Shared<low_level::DeviceHandle>, int iso_packets);
+
+	/**
+	 * Throw StatusException (LIBUSB_ERROR_BUSY) if the transfer is in flight.
+	 */
+	void
+	check_not_in_flight() const;
+
+	/**
+	 * Common part of fill_bulk_*() and fill_interrupt_*().
+	 * Stream ID is given only for bulk stream transfers.
+	 */
+	void
+	fill (TransferType, uint8_t endpoint, Span<uint8_t> buffer, int timeout_ms, Optional<uint32_t> stream_id = { });
+
+	/**
+	 * Common part of fill_control_*().
+	 */
+	void
+	fill_control (uint8_t request_type, ControlTransfer const&, Span<uint8_t> buffer, int timeout_ms);
+
+	/**
+	 * Common part of fill_iso_*().
+	 */
+	void
+	fill_iso (uint8_t endpoint, Span<uint8_t> buffer, std::size_t packet_length, int timeout_ms);
+
+	/**
+	 * Callback passed to libusb.
+	 */
+	static void LIBUSB_CALL
+	handle_completion (libusb_transfer*);
+
+  private:
+	Shared<low_level::DeviceHandle>	_handle;
+	libusb_transfer*				_transfer;
+	Span<uint8_t>					_buffer;
+	// Setup packet + data stage for control transfers:
+	std::vector<uint8_t>			_control_buffer;
+	int								_iso_packets;
+	std::size_t						_iso_packet_length	= 0;
+	Callback						_callback;
+	// Set while in flight:
+	Shared<Transfer>				_self;
+	std::atomic<bool>				_in_flight	{ false };
+};
+
+
+inline bool
+Transfer::in_flight() const noexcept
+{
+	return _in_flight.load (std::memory_order_acquire);
+}
+
+
+inline TransferStatus
+Transfer::status() const noexcept
+{
+	return static_cast<TransferStatus> (_transfer->status);
+}
+
+
+inline std::size_t
+Transfer::actual_length() const noexcept
+{
+	return static_cast<std::size_t> (_transfer->actual_length);
+}
+
+
+inline std::size_t
+Transfer::iso_packets() const noexcept
+{
+	return static_cast<std::size_t> (_iso_packets);
+}
+
+
+inline Transfer::IsoPacket
+Transfer::iso_packet (std::size_t index) const noexcept
+{
+	auto const& descriptor = _transfer->iso_packet_desc[index];
+	auto const length = std::min<std::size_t> (descriptor.actual_length, _iso_packet_length);
+
+	return { static_cast<TransferStatus> (descriptor.status), _buffer.subspan (index * _iso_packet_length, length) };
+}
+
+
+inline Span<uint8_t>
+Transfer::buffer() const noexcept
+{
+	return _buffer;
+}
+
+
+inline Span<uint8_t>
+Transfer::data() const noexcept
+{
+	return _buffer.subspan (0, std::min (actual_length(), _buffer.size()));
+}
+
+
+inline libusb_transfer*
+Transfer::get_libusb_transfer() const noexcept
+{
+	return _transfer;
+}
+
+} // namespace libusb
+
+#endif
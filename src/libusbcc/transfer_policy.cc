@@ -0,0 +1,101 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+// Standard:
+#include <algorithm>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "transfer_policy.h"
+
+
+namespace libusb {
+
+TransferPolicy::TransferPolicy (Speed speed, ConfigDescriptor const& config, Endpoint const& endpoint,
+								std::chrono::microseconds transfer_duration, std::chrono::microseconds queue_duration)
+{
+	// Malformed descriptor or zero-bandwidth alternate setting:
+	if (config.burst_size (endpoint) == 0)
+		throw StatusException (LIBUSB_ERROR_INVALID_PARAM);
+
+	if (endpoint.transfer_type() != TransferType::Bulk)
+	{
+		_transfer_size = config.burst_size (endpoint);
+		return;
+	}
+
+	auto const per_ms = bytes_per_millisecond (speed, endpoint.max_packet_size());
+	auto const transfer_us = std::max<std::size_t> (transfer_duration.count(), 1);
+	auto const queue_us = std::max<std::size_t> (queue_duration.count(), transfer_us);
+
+	_transfer_size = config.aligned_transfer_size (endpoint, per_ms * transfer_us / 1000);
+	// Round up, so that the queue covers at least queue_duration:
+	auto const queue_size = per_ms * queue_us / 1000;
+	_queue_depth = std::max<std::size_t> ((queue_size + _transfer_size - 1) / _transfer_size, 2);
+}
+
+
+TransferPolicy
+TransferPolicy::for_endpoint (DeviceDescriptor const& device, uint8_t endpoint_address, uint8_t config_index)
+{
+	auto const& config = device.config_descriptor (config_index);
+	auto endpoint = config.find_endpoint (endpoint_address);
+
+	if (!endpoint)
+		throw UnavailableException();
+
+	return TransferPolicy (device.speed(), config, *endpoint);
+}
+
+
+std::size_t
+TransferPolicy::bytes_per_millisecond (Speed speed, std::size_t max_packet_size) noexcept
+{
+	// Max. bulk packets per millisecond on an otherwise idle bus:
+	std::size_t packets;
+
+	switch (speed)
+	{
+		case Speed::Low:
+			// No bulk on low-speed links; one packet per frame:
+			packets = 1;
+			break;
+
+		case Speed::Full:
+			// 19 packets per 1 ms frame:
+			packets = 19;
+			break;
+
+		case Speed::Super:
+			// 5 Gbit/s with 8b/10b coding and protocol overhead, ~400 MB/s:
+			packets = 400;
+			break;
+
+		case Speed::SuperPlus:
+			// 10 Gbit/s with 128b/132b coding and protocol overhead, ~900 MB/s:
+			packets = 900;
+			break;
+
+		case Speed::High:
+		default:
+			// 13 packets per 125 µs microframe:
+			packets = 13 * 8;
+			break;
+	}
+
+	return packets * std::max<std::size_t> (max_packet_size, 1);
+}
+
+} // namespace libusb
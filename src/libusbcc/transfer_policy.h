@@ -0,0 +1,124 @@
+/* vim:ts=4
+ *
+ * Copyleft 2014…2015  Michał Gawron
+ * Marduk Unix Labs, http://mulabs.org/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Visit http://www.gnu.org/licenses/gpl-3.0.html for more information on licensing.
+ */
+
+#ifndef MULABS_ORG__LIBUSBCC__TRANSFER_POLICY_H__INCLUDED
+#define MULABS_ORG__LIBUSBCC__TRANSFER_POLICY_H__INCLUDED
+
+// Standard:
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Lib:
+#include <libusb.h>
+
+// Local:
+#include "libusbcc.h"
+#include "config_descriptor.h"
+
+
+namespace libusb {
+
+/**
+ * Default transfer size and number of transfers to keep in flight
+ * for a bulk endpoint, derived from the negotiated link speed and
+ * the endpoint's max. packet size and burst.
+ *
+ * Transfers are sized to keep the endpoint busy for transfer_duration at
+ * the link's nominal bulk throughput, rounded up to whole bursts. Enough
+ * transfers are queued to cover queue_duration, so that the host controller
+ * doesn't run dry while completed transfers are processed and resubmitted.
+ *
+ * For non-bulk endpoints the transfer size is a single burst.
+ */
+class TransferPolicy
+{
+  public:
+	/**
+	 * Ctor
+	 * Throws StatusException (LIBUSB_ERROR_INVALID_PARAM) if the endpoint's
+	 * max. packet size is 0.
+	 *
+	 * \param	transfer_duration
+	 * 			Link time one transfer should take. Longer means fewer
+	 * 			completions per second, but higher latency.
+	 * \param	queue_duration
+	 * 			Link time all queued transfers should take together.
+	 */
+	explicit TransferPolicy (Speed, ConfigDescriptor const&, Endpoint const&,
+							 std::chrono::microseconds transfer_duration = std::chrono::milliseconds (1),
+							 std::chrono::microseconds queue_duration = std::chrono::milliseconds (8));
+
+	/**
+	 * Return policy for endpoint with given address in given configuration
+	 * of the device. Throws UnavailableException if there's no such endpoint.
+	 */
+	static TransferPolicy
+	for_endpoint (DeviceDescriptor const&, uint8_t endpoint_address, uint8_t config_index = 0);
+
+	/**
+	 * Return size of a single transfer in bytes.
+	 * Always a multiple of the endpoint's burst size.
+	 */
+	std::size_t
+	transfer_size() const noexcept;
+
+	/**
+	 * Return number of transfers to keep in flight (at least 2).
+	 */
+	std::size_t
+	queue_depth() const noexcept;
+
+	/**
+	 * Return total number of bytes in flight: transfer_size() * queue_depth().
+	 */
+	std::size_t
+	queued_bytes() const noexcept;
+
+	/**
+	 * Return nominal number of bulk payload bytes per millisecond
+	 * for given link speed and max. packet size. Approximate; actual
+	 * throughput depends on the host controller and bus load.
+	 */
+	static std::size_t
+	bytes_per_millisecond (Speed, std::size_t max_packet_size) noexcept;
+
+  private:
+	std::size_t	_transfer_size	= 0;
+	std::size_t	_queue_depth	= 2;
+};
+
+
+inline std::size_t
+TransferPolicy::transfer_size() const noexcept
+{
+	return _transfer_size;
+}
+
+
+inline std::size_t
+TransferPolicy::queue_depth() const noexcept
+{
+	return _queue_depth;
+}
+
+
+inline std::size_t
+TransferPolicy::queued_bytes() const noexcept
+{
+	return _transfer_size * _queue_depth;
+}
+
+} // namespace libusb
+
+#endif